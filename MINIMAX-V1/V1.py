@@ -1,13 +1,16 @@
 import pygame
 import os
-import copy
-import random
+import queue
+
+from chessengine import Engine
 
 # Initialize Pygame
 pygame.init()
 
 # Set up the display
-WIDTH, HEIGHT = 640, 640
+WIDTH, BOARD_HEIGHT = 640, 640
+PANEL_HEIGHT = 60  # engine output below the board
+HEIGHT = BOARD_HEIGHT + PANEL_HEIGHT
 SCREEN = pygame.display.set_mode((WIDTH, HEIGHT))
 pygame.display.set_caption("Chess Board")
 
@@ -16,6 +19,9 @@ WHITE = (255, 255, 255)
 BROWN = (139, 69, 19)
 HIGHLIGHT = (255, 255, 0)
 MOVE_HIGHLIGHT = (0, 255, 0, 128)  # Semi-transparent green
+PANEL_COLOR = (40, 40, 40)
+PANEL_TEXT = (230, 230, 230)
+FONT = pygame.font.SysFont('monospace', 16)
 
 # Define board dimensions
 BOARD_SIZE = 8
@@ -25,7 +31,8 @@ SQUARE_SIZE = WIDTH // BOARD_SIZE
 PIECES = {}
 for color in ['white', 'black']:
     for piece in ['king', 'queen', 'bishop', 'knight', 'rook', 'pawn']:
-        image = pygame.image.load(os.path.join('Images', f'{color}-{piece}.png'))
+        image = pygame.image.load(os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                               'images', f'{color}-{piece}.png'))
         PIECES[f'{color}_{piece}'] = pygame.transform.scale(image, (SQUARE_SIZE, SQUARE_SIZE))
 
 # FEN to board conversion
@@ -46,15 +53,16 @@ def fen_to_board(fen):
                 col += 1
     return board
 
-# Initial FEN
-INITIAL_FEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
-board = fen_to_board(INITIAL_FEN)
-
-# Castling rights
-castling_rights = {'white': {'kingside': True, 'queenside': True},
-                   'black': {'kingside': True, 'queenside': True}}
+# The C++ engine keeps the game, the board here is only for drawing
+engine = Engine()
+moves = []  # played so far, in UCI notation
+AI_MOVE_TIME = 3000  # ms, space makes the engine move at once
 
-last_move = None
+# The engine searches on its own thread and hands its lines over through this
+# queue, the position is read while it's idle and kept for drawing
+engine_lines = queue.Queue()
+thinking = False
+analysis = {}  # depth, score and pv of the latest info line
 
 def highlight_king_in_check(color):
     king_pos = None
@@ -80,10 +88,23 @@ def draw_board():
                 SCREEN.blit(PIECES[piece], (col * SQUARE_SIZE, row * SQUARE_SIZE))
 
     # Highlight the king in red if in check
-    if is_king_in_check('white', board):
-        highlight_king_in_check('white')
-    if is_king_in_check('black', board):
-        highlight_king_in_check('black')
+    if in_check:
+        highlight_king_in_check(side_to_move())
+
+def draw_panel():
+    pygame.draw.rect(SCREEN, PANEL_COLOR, (0, BOARD_HEIGHT, WIDTH, PANEL_HEIGHT))
+    if thinking:
+        status = 'thinking, space to move now'
+    elif not all_legal_moves:
+        status = 'checkmate' if in_check else 'stalemate'
+    else:
+        status = 'your move'
+    if analysis:
+        status += f"   depth {analysis['depth']}   eval {analysis['score']}"
+    lines = [status, 'pv ' + ' '.join(analysis['pv']) if analysis else '']
+    for i, line in enumerate(lines):
+        text = FONT.render(line, True, PANEL_TEXT)
+        SCREEN.blit(text, (10, BOARD_HEIGHT + 8 + i * 22))
 
 
 def get_square(pos):
@@ -92,344 +113,73 @@ def get_square(pos):
     col = x // SQUARE_SIZE
     return row, col
 
-def is_valid_square(row, col):
-    return 0 <= row < BOARD_SIZE and 0 <= col < BOARD_SIZE
-
-def get_pseudo_legal_moves(row, col, current_board):
-    global last_move
-    piece = current_board[row][col]
-    if not piece:
-        return []
-
-    color, piece_type = piece.split('_')
-    opponent_color = 'black' if color == 'white' else 'white'
-    moves = []
-
-    if piece_type == 'pawn':
-        direction = -1 if color == 'white' else 1
-        if is_valid_square(row + direction, col) and current_board[row + direction][col] is None:
-            moves.append((row + direction, col))
-            if (color == 'white' and row == 6) or (color == 'black' and row == 1):
-                if is_valid_square(row + 2 * direction, col) and current_board[row + 2 * direction][col] is None:
-                    moves.append((row + 2 * direction, col))
-        for dc in [-1, 1]:
-            if is_valid_square(row + direction, col + dc):
-                target = current_board[row + direction][col + dc]
-                if target and target.split('_')[0] != color:
-                    moves.append((row + direction, col + dc))
-
-        # En passant
-        if last_move:
-            (last_from, last_to) = last_move
-            last_from_row, last_from_col = last_from
-            last_to_row, last_to_col = last_to
-            if current_board[last_to_row][last_to_col] == f'{opponent_color}_pawn':
-                if abs(last_from_row - last_to_row) == 2 and last_to_row == row:
-                    if last_to_col == col + 1 or last_to_col == col - 1:
-                        moves.append((row + direction, last_to_col))
-
-    elif piece_type == 'knight':
-        for dr, dc in [(-2, -1), (-2, 1), (-1, -2), (-1, 2), (1, -2), (1, 2), (2, -1), (2, 1)]:
-            r, c = row + dr, col + dc
-            if is_valid_square(r, c) and (current_board[r][c] is None or current_board[r][c].split('_')[0] != color):
-                moves.append((r, c))
-
-    elif piece_type in ['bishop', 'rook', 'queen']:
-        directions = []
-        if piece_type in ['bishop', 'queen']:
-            directions.extend([(-1, -1), (-1, 1), (1, -1), (1, 1)])
-        if piece_type in ['rook', 'queen']:
-            directions.extend([(-1, 0), (1, 0), (0, -1), (0, 1)])
-
-        for dr, dc in directions:
-            r, c = row + dr, col + dc
-            while is_valid_square(r, c):
-                if current_board[r][c] is None:
-                    moves.append((r, c))
-                elif current_board[r][c].split('_')[0] != color:
-                    moves.append((r, c))
-                    break
-                else:
-                    break
-                r, c = r + dr, c + dc
-
-    elif piece_type == 'king':
-        for dr in [-1, 0, 1]:
-            for dc in [-1, 0, 1]:
-                if dr == 0 and dc == 0:
-                    continue
-                r, c = row + dr, col + dc
-                if is_valid_square(r, c) and (current_board[r][c] is None or current_board[r][c].split('_')[0] != color):
-                    moves.append((r, c))
-
-        # Castling
-        if color == 'white' and row == 7 and col == 4:
-            if castling_rights['white']['kingside'] and all(current_board[7][c] is None for c in range(5, 7)) and current_board[7][7] == 'white_rook':
-                moves.append((7, 6))
-            if castling_rights['white']['queenside'] and all(current_board[7][c] is None for c in range(1, 4)) and current_board[7][0] == 'white_rook':
-                moves.append((7, 2))
-        elif color == 'black' and row == 0 and col == 4:
-            if castling_rights['black']['kingside'] and all(current_board[0][c] is None for c in range(5, 7)) and current_board[0][7] == 'black_rook':
-                moves.append((0, 6))
-            if castling_rights['black']['queenside'] and all(current_board[0][c] is None for c in range(1, 4)) and current_board[0][0] == 'black_rook':
-                moves.append((0, 2))
-
-    return moves
-
-def get_all_legal_moves(color, current_board):
-    legal_moves = []
-    for row in range(BOARD_SIZE):
-        for col in range(BOARD_SIZE):
-            if current_board[row][col] and current_board[row][col].startswith(color):
-                moves = get_legal_moves(row, col, current_board)
-                for move in moves:
-                    legal_moves.append(((row, col), move))
-    return legal_moves
+def side_to_move():
+    return 'white' if fen.split()[1] == 'w' else 'black'
 
-def make_ai_move(color, move_count):
-    global board
-    _, best_move = minimax(board, 2, float('-inf'), float('inf'), True, color, move_count)
-    if best_move:
-        board = move_piece(best_move[0], best_move[1], board)
+def square_name(row, col):
+    return 'abcdefgh'[col] + str(8 - row)
 
+def square_of(name):
+    return 8 - int(name[1]), 'abcdefgh'.index(name[0])
 
-def is_king_in_check(color, current_board):
-    # Find the king's position
-    king_pos = None
-    for row in range(BOARD_SIZE):
-        for col in range(BOARD_SIZE):
-            if current_board[row][col] == f'{color}_king':
-                king_pos = (row, col)
-                break
-        if king_pos:
-            break
+def get_legal_moves(row, col):
+    # squares the piece on row, col can move to
+    start = square_name(row, col)
+    return [square_of(move[2:4]) for move in all_legal_moves if move[:2] == start]
 
-    # Check if any opponent's piece can capture the king
-    opponent_color = 'black' if color == 'white' else 'white'
-    for row in range(BOARD_SIZE):
-        for col in range(BOARD_SIZE):
-            piece = current_board[row][col]
-            if piece and piece.startswith(opponent_color):
-                moves = get_pseudo_legal_moves(row, col, current_board)
-                if king_pos in moves:
-                    return True
-    return False
-
-def get_all_legal_moves(color, current_board):
-    legal_moves = []
-    for row in range(BOARD_SIZE):
-        for col in range(BOARD_SIZE):
-            if current_board[row][col] and current_board[row][col].startswith(color):
-                moves = get_legal_moves(row, col, current_board)
-                for move in moves:
-                    legal_moves.append(((row, col), move))
-    return legal_moves
-
-def get_legal_moves(row, col, current_board):
-    color = current_board[row][col].split('_')[0]
-    pseudo_legal_moves = get_pseudo_legal_moves(row, col, current_board)
-    legal_moves = []
-
-    for move in pseudo_legal_moves:
-        # Make a copy of the board and make the move
-        temp_board = copy.deepcopy(current_board)
-        from_row, from_col = row, col
-        to_row, to_col = move
-
-        # Handle en passant
-        if current_board[row][col].endswith('_pawn') and from_col != to_col and current_board[to_row][to_col] is None:
-            temp_board[from_row][to_col] = None
-
-        temp_board[to_row][to_col] = temp_board[from_row][from_col]
-        temp_board[from_row][from_col] = None
-
-        # Check if the king is in check after the move
-        if not is_king_in_check(color, temp_board):
-            legal_moves.append(move)
-
-    return legal_moves
-
-def evaluate_board(board, color, move_count):
-    material_score = 0
-    positional_score = 0
-    development_score = 0
-    
-    king_wt = 200
-    queen_wt = 9
-    rook_wt = 5
-    knight_wt = 3
-    bishop_wt = 3
-    pawn_wt = 1
-    mobility_wt = 0.1
-
-    # Central squares
-    central_squares = [(3,3), (3,4), (4,3), (4,4)]
-    semi_central_squares = [(2,2), (2,3), (2,4), (2,5), (3,2), (3,5), (4,2), (4,5), (5,2), (5,3), (5,4), (5,5)]
-
-    # Long diagonals
-    long_diagonals = [(0,0), (1,1), (2,2), (3,3), (4,4), (5,5), (6,6), (7,7),
-                      (0,7), (1,6), (2,5), (3,4), (4,3), (5,2), (6,1), (7,0)]
-
-    piece_counts = {'white': {}, 'black': {}}
-    for row in range(BOARD_SIZE):
-        for col in range(BOARD_SIZE):
-            piece = board[row][col]
-            if piece:
-                piece_color, piece_type = piece.split('_')
-                piece_counts[piece_color][piece_type] = piece_counts[piece_color].get(piece_type, 0) + 1
-
-                # Positional bonuses
-                if piece_type == 'pawn':
-                    if (row, col) in central_squares:
-                        positional_score += 0.5 if piece_color == 'white' else -0.5
-                    elif (row, col) in semi_central_squares:
-                        positional_score += 0.3 if piece_color == 'white' else -0.3
-                    # Bonus for advancing center pawns in the opening
-                    if move_count < 10:
-                        if piece_color == 'white' and row < 6 and (col == 3 or col == 4):
-                            positional_score += 0.2 * (6 - row)
-                        elif piece_color == 'black' and row > 1 and (col == 3 or col == 4):
-                            positional_score -= 0.2 * (row - 1)
-
-                elif piece_type == 'knight':
-                    if (row, col) in central_squares:
-                        positional_score += 0.7 if piece_color == 'white' else -0.7
-                    elif (row, col) in semi_central_squares:
-                        positional_score += 0.5 if piece_color == 'white' else -0.5
-
-                elif piece_type == 'bishop':
-                    if (row, col) in long_diagonals:
-                        positional_score += 0.5 if piece_color == 'white' else -0.5
-
-                elif piece_type == 'king':
-                    # Encourage early castling
-                    if piece_color == 'white':
-                        if (row, col) in [(7,1), (7,2), (7,6), (7,7)]:
-                            positional_score += 0.7
-                    else:
-                        if (row, col) in [(0,1), (0,2), (0,6), (0,7)]:
-                            positional_score -= 0.7
-
-                # Penalize undeveloped pieces in the opening and early middlegame
-                if move_count < 20:
-                    if piece_color == 'white':
-                        if piece_type in ['knight', 'bishop'] and row == 7:
-                            development_score -= 0.5
-                        elif piece_type == 'rook' and col in [0, 7] and row == 7:
-                            development_score -= 0.3
-                    else:
-                        if piece_type in ['knight', 'bishop'] and row == 0:
-                            development_score += 0.5
-                        elif piece_type == 'rook' and col in [0, 7] and row == 0:
-                            development_score += 0.3
-
-    material_score = (
-        king_wt * (piece_counts['white'].get('king', 0) - piece_counts['black'].get('king', 0)) +
-        queen_wt * (piece_counts['white'].get('queen', 0) - piece_counts['black'].get('queen', 0)) +
-        rook_wt * (piece_counts['white'].get('rook', 0) - piece_counts['black'].get('rook', 0)) +
-        knight_wt * (piece_counts['white'].get('knight', 0) - piece_counts['black'].get('knight', 0)) +
-        bishop_wt * (piece_counts['white'].get('bishop', 0) - piece_counts['black'].get('bishop', 0)) +
-        pawn_wt * (piece_counts['white'].get('pawn', 0) - piece_counts['black'].get('pawn', 0))
-    )
-
-    white_mobility = sum(len(get_legal_moves(row, col, board)) for row in range(BOARD_SIZE) for col in range(BOARD_SIZE) if board[row][col] and board[row][col].startswith('white'))
-    black_mobility = sum(len(get_legal_moves(row, col, board)) for row in range(BOARD_SIZE) for col in range(BOARD_SIZE) if board[row][col] and board[row][col].startswith('black'))
-    mobility_score = mobility_wt * (white_mobility - black_mobility)
-
-    eval_score = material_score + positional_score + mobility_score + development_score
-    return eval_score if color == 'white' else -eval_score
-
-def minimax(board, depth, alpha, beta, maximizing_player, color, move_count):
-    if depth == 0:
-        return evaluate_board(board, color, move_count), None
-
-    best_move = None
-    if maximizing_player:
-        max_eval = float('-inf')
-        for move in get_all_legal_moves(color, board):
-            temp_board = copy.deepcopy(board)
-            temp_board = move_piece(move[0], move[1], temp_board)
-            eval, _ = minimax(temp_board, depth - 1, alpha, beta, False, 'black' if color == 'white' else 'white', move_count + 1)
-            if eval > max_eval:
-                max_eval = eval
-                best_move = move
-            alpha = max(alpha, eval)
-            if beta <= alpha:
-                break
-        return max_eval, best_move
-    else:
-        min_eval = float('inf')
-        for move in get_all_legal_moves(color, board):
-            temp_board = copy.deepcopy(board)
-            temp_board = move_piece(move[0], move[1], temp_board)
-            eval, _ = minimax(temp_board, depth - 1, alpha, beta, True, 'black' if color == 'white' else 'white', move_count + 1)
-            if eval < min_eval:
-                min_eval = eval
-                best_move = move
-            beta = min(beta, eval)
-            if beta <= alpha:
-                break
-        return min_eval, best_move
-    
+def update_position():
+    global fen, board, in_check, all_legal_moves
+    fen = engine.fen()
+    board = fen_to_board(fen)
+    in_check = engine.in_check()
+    all_legal_moves = engine.legal_moves()
 
+def make_move(move):
+    moves.append(move)
+    engine.set_position(None, moves)
+    update_position()
 
-def move_piece(from_pos, to_pos, current_board=None):
-    global board, castling_rights, last_move
-    if current_board is None:
-        current_board = board
-
-    from_row, from_col = from_pos
-    to_row, to_col = to_pos
-    piece = current_board[from_row][from_col]
-    color, piece_type = piece.split('_')
-
-    # Update castling rights
-    if piece_type == 'king':
-        castling_rights[color]['kingside'] = False
-        castling_rights[color]['queenside'] = False
-    elif piece_type == 'rook':
-        if from_col == 0:  # Queenside rook
-            castling_rights[color]['queenside'] = False
-        elif from_col == 7:  # Kingside rook
-            castling_rights[color]['kingside'] = False
-
-    # Handle castling
-    if piece_type == 'king' and abs(from_col - to_col) == 2:
-        if to_col > from_col:  # Kingside
-            current_board[to_row][to_col - 1] = current_board[to_row][7]
-            current_board[to_row][7] = None
-        else:  # Queenside
-            current_board[to_row][to_col + 1] = current_board[to_row][0]
-            current_board[to_row][0] = None
-
-    # Handle en passant
-    if piece_type == 'pawn' and from_col != to_col and current_board[to_row][to_col] is None:
-        current_board[from_row][to_col] = None
-
-    # Move the piece
-    current_board[to_row][to_col] = piece
-    current_board[from_row][from_col] = None
-
-    # Handle pawn promotion
-    if piece_type == 'pawn' and (to_row == 0 or to_row == 7):
-        promote_pawn(to_row, to_col, current_board)
-
-    # Only make AI move and update last_move if we're modifying the actual game board
-    if current_board is board:
-        last_move = (from_pos, to_pos)
-        # if color == 'white':
-        #     make_ai_move('black')
-
-    return current_board
-
-def promote_pawn(row, col, current_board):
+def start_ai_move():
+    global thinking
+    if not all_legal_moves:
+        return
+    analysis.clear()
+    thinking = True
+    engine.start(on_line=engine_lines.put, movetime=AI_MOVE_TIME)
+
+def format_score(words, white_to_move):
+    # eval of an info line from white's view, the engine's is the side to move's
+    sign = 1 if white_to_move else -1
+    kind, value = words[words.index('score') + 1:words.index('score') + 3]
+    if kind == 'mate':
+        return f'mate {sign * int(value)}'
+    return f'{sign * int(value) / 100:+.2f}'
+
+def poll_engine():
+    # handles the lines the search thread queued since the last frame
+    global thinking
+    while not engine_lines.empty():
+        words = engine_lines.get_nowait().split()
+        if words[0] == 'bestmove':
+            thinking = False
+            if words[1] != '0000':
+                make_move(words[1])
+        elif words[0] == 'info' and 'depth' in words and 'score' in words and 'pv' in words:
+            analysis['depth'] = words[words.index('depth') + 1]
+            analysis['score'] = format_score(words, side_to_move() == 'white')
+            analysis['pv'] = words[words.index('pv') + 1:]
+
+def move_piece(from_pos, to_pos):
+    move = square_name(*from_pos) + square_name(*to_pos)
+    piece = board[from_pos[0]][from_pos[1]]
+    if piece.endswith('_pawn') and to_pos[0] in (0, 7):
+        move += promote_pawn(to_pos[0], to_pos[1])
+    make_move(move)
+
+def promote_pawn(row, col):
+    # the letter of the piece the player picks
     color = 'white' if row == 0 else 'black'
     options = ['queen', 'rook', 'bishop', 'knight']
-    
-    # If it's the AI's turn, always promote to queen
-    if current_board is not board:
-        current_board[row][col] = f'{color}_queen'
-        return
 
     # Create a simple menu for promotion selection
     menu_height = 200
@@ -439,29 +189,22 @@ def promote_pawn(row, col, current_board):
         piece_img = PIECES[f'{color}_{piece}']
         menu.blit(piece_img, (i * SQUARE_SIZE, (menu_height - SQUARE_SIZE) // 2))
     
-    SCREEN.blit(menu, (0, (HEIGHT - menu_height) // 2))
+    SCREEN.blit(menu, (0, (BOARD_HEIGHT - menu_height) // 2))
     pygame.display.flip()
     
-    waiting = True
-    while waiting:
+    while True:
         for event in pygame.event.get():
             if event.type == pygame.MOUSEBUTTONDOWN:
                 x, _ = pygame.mouse.get_pos()
                 selected = x // SQUARE_SIZE
                 if 0 <= selected < len(options):
-                    current_board[row][col] = f'{color}_{options[selected]}'
-                    waiting = False
-    
-    # Redraw the board after promotion
-    SCREEN.fill(WHITE)
-    draw_board()
-    pygame.display.flip()
+                    return 'qrbn'[selected]
 
+update_position()
 running = True
 selected_piece = None
 selected_pos = None
 legal_moves = []
-move_count = 0
 
 clock = pygame.time.Clock()
 
@@ -469,28 +212,32 @@ while running:
     for event in pygame.event.get():
         if event.type == pygame.QUIT:
             running = False
-        elif event.type == pygame.MOUSEBUTTONDOWN:
+        elif event.type == pygame.KEYDOWN:
+            if event.key == pygame.K_SPACE and thinking:
+                engine.stop()  # its bestmove arrives through the queue
+        elif event.type == pygame.MOUSEBUTTONDOWN and not thinking:
             if event.button == 1:  # Left mouse button
                 row, col = get_square(event.pos)
-                if board[row][col]:
+                if row < BOARD_SIZE and board[row][col] and board[row][col].startswith(side_to_move()):
                     selected_piece = board[row][col]
                     selected_pos = (row, col)
-                    legal_moves = get_legal_moves(row, col, board)
+                    legal_moves = get_legal_moves(row, col)
         elif event.type == pygame.MOUSEBUTTONUP:
             if event.button == 1 and selected_piece:
                 new_row, new_col = get_square(event.pos)
                 if (new_row, new_col) in legal_moves:
                     move_piece(selected_pos, (new_row, new_col))
-                    move_count += 1
                     # AI move
-                    make_ai_move('black', move_count)
-                    move_count += 1
+                    start_ai_move()
                 selected_piece = None
                 selected_pos = None
                 legal_moves = []
 
+    poll_engine()
+
     SCREEN.fill(WHITE)
     draw_board()
+    draw_panel()
     
     # Highlight selected piece and legal moves
     if selected_pos:
@@ -505,4 +252,6 @@ while running:
     pygame.display.flip()
     clock.tick(60)  # Limit to 60 FPS
 
+engine.stop()
+engine.close()
 pygame.quit()
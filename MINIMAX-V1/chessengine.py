@@ -0,0 +1,161 @@
+"""Python bindings for libchessengine, the C API in chessengine.h.
+
+Build the library with make in the repository root first. It is looked up
+next to this file's parent directory, or at $CHESSENGINE_LIB.
+"""
+import ctypes
+import os
+
+LIMITS = ('depth', 'movetime', 'wtime', 'btime', 'winc', 'binc', 'mate', 'infinite')
+
+
+class Limits(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_int) for name in LIMITS]
+
+
+BUSY = -2**31  # CHESS_ENGINE_BUSY, a search is running
+
+LINE_CALLBACK = ctypes.CFUNCTYPE(None, ctypes.c_char_p, ctypes.c_void_p)
+
+
+def _load():
+    path = os.environ.get('CHESSENGINE_LIB') or os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), '..', 'libchessengine.so')
+    lib = ctypes.CDLL(path)
+    handle, c_int, c_char_p = ctypes.c_void_p, ctypes.c_int, ctypes.c_char_p
+    signatures = {
+        'chess_engine_create': (handle, []),
+        'chess_engine_destroy': (None, [handle]),
+        'chess_engine_set_position': (c_int, [handle, c_char_p, c_char_p]),
+        'chess_engine_get_fen': (ctypes.c_size_t, [handle, c_char_p, ctypes.c_size_t]),
+        'chess_engine_set_option': (c_int, [handle, c_char_p, c_char_p]),
+        'chess_engine_new_game': (None, [handle]),
+        'chess_engine_search': (c_int, [handle, ctypes.POINTER(Limits), c_char_p,
+                                        LINE_CALLBACK, ctypes.c_void_p]),
+        'chess_engine_start': (c_int, [handle, ctypes.POINTER(Limits),
+                                       LINE_CALLBACK, ctypes.c_void_p]),
+        'chess_engine_stop': (c_int, [handle, c_char_p]),
+        'chess_engine_wait': (c_int, [handle, c_char_p]),
+        'chess_engine_is_searching': (c_int, [handle]),
+        'chess_engine_legal_moves': (c_int, [handle, c_char_p, ctypes.c_size_t]),
+        'chess_engine_in_check': (c_int, [handle]),
+        'chess_engine_perft': (ctypes.c_uint64, [handle, c_int]),
+        'chess_engine_eval': (c_int, [handle]),
+    }
+    for name, (restype, argtypes) in signatures.items():
+        function = getattr(lib, name)
+        function.restype = restype
+        function.argtypes = argtypes
+    return lib
+
+
+_lib = _load()
+
+
+def _limits(limits):
+    unknown = set(limits) - set(LIMITS)
+    if unknown:
+        raise TypeError(f'unknown search limits {sorted(unknown)}')
+    return Limits(**{name: int(value) for name, value in limits.items()})
+
+
+def _callback(on_line):
+    if on_line is None:
+        return ctypes.cast(None, LINE_CALLBACK)
+    return LINE_CALLBACK(lambda line, _: on_line(line.decode()))
+
+
+def _move(bestmove):
+    move = bestmove.value.decode()
+    return None if move == '0000' else move
+
+
+class Engine:
+    """One engine: a position, its search threads and hash table.
+
+    Moves are strings in UCI notation, e.g. 'e2e4' or 'e7e8q'. Search limits
+    are the keyword arguments depth, movetime, wtime, btime, winc, binc,
+    mate and infinite, times in milliseconds.
+    """
+
+    def __init__(self):
+        self._handle = _lib.chess_engine_create()
+        if not self._handle:
+            raise MemoryError("can't allocate the hash table")
+        self._on_line = None  # the running search's callback, kept alive
+
+    def close(self):
+        if self._handle:
+            _lib.chess_engine_destroy(self._handle)
+            self._handle = None
+
+    def __del__(self):
+        self.close()
+
+    def set_position(self, fen=None, moves=()):
+        """fen None for the starting position, ValueError if the fen or a
+        move is invalid"""
+        if _lib.chess_engine_set_position(self._handle, fen and fen.encode(),
+                                          ' '.join(moves).encode()):
+            raise ValueError(f'invalid position {fen} moves {" ".join(moves)}')
+
+    def fen(self):
+        buffer = ctypes.create_string_buffer(128)
+        _lib.chess_engine_get_fen(self._handle, buffer, len(buffer))
+        return buffer.value.decode()
+
+    def set_option(self, name, value):
+        if _lib.chess_engine_set_option(self._handle, name.encode(), str(value).encode()):
+            raise ValueError(f'unknown option {name}')
+
+    def new_game(self):
+        _lib.chess_engine_new_game(self._handle)
+
+    def legal_moves(self):
+        buffer = ctypes.create_string_buffer(256 * 6)
+        _lib.chess_engine_legal_moves(self._handle, buffer, len(buffer))
+        return buffer.value.decode().split()
+
+    def in_check(self):
+        return bool(_lib.chess_engine_in_check(self._handle))
+
+    def perft(self, depth):
+        return _lib.chess_engine_perft(self._handle, depth)
+
+    def eval(self):
+        """static evaluation in centipawns, from white's view"""
+        return _lib.chess_engine_eval(self._handle)
+
+    def search(self, on_line=None, **limits):
+        """searches until a limit is reached, returns the best move, None if
+        there are no legal moves, and its score from the side to move's view.
+        on_line gets each info and bestmove line"""
+        bestmove = ctypes.create_string_buffer(6)
+        callback = _callback(on_line)
+        score = _lib.chess_engine_search(self._handle, ctypes.byref(_limits(limits)),
+                                         bestmove, callback, None)
+        if score == BUSY:
+            raise RuntimeError('a search is running')
+        return _move(bestmove), score
+
+    def start(self, on_line=None, **limits):
+        """search in the background, on_line is called from the search thread"""
+        self._on_line = _callback(on_line)
+        if _lib.chess_engine_start(self._handle, ctypes.byref(_limits(limits)),
+                                   self._on_line, None):
+            raise RuntimeError('a search is running')
+
+    def stop(self):
+        """stops the started search, returns its move and score like search"""
+        bestmove = ctypes.create_string_buffer(6)
+        score = _lib.chess_engine_stop(self._handle, bestmove)
+        return _move(bestmove), score
+
+    def wait(self):
+        """waits for the started search, returns its move and score"""
+        bestmove = ctypes.create_string_buffer(6)
+        score = _lib.chess_engine_wait(self._handle, bestmove)
+        return _move(bestmove), score
+
+    def searching(self):
+        return bool(_lib.chess_engine_is_searching(self._handle))
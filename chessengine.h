@@ -0,0 +1,107 @@
+// C interface of libchessengine, build it with make (see the Makefile).
+// Every engine is independent: its own position, search threads and hash
+// table, so many can live in one process. An engine must not be used from
+// two threads at once, except for chess_engine_stop and
+// chess_engine_is_searching. A started search uses the engine's position
+// until it's done, see chess_engine_is_searching.
+#ifndef CHESSENGINE_H
+#define CHESSENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the library is built with hidden symbols, only these are exported
+#ifdef __GNUC__
+#define CHESS_API __attribute__((visibility("default")))
+#else
+#define CHESS_API
+#endif
+
+// chess_engine_search's result when a search is already running, no score
+// comes close to it
+#define CHESS_ENGINE_BUSY (-0x7fffffff - 1)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef struct chess_engine chess_engine;
+
+    // search limits, zero means not set. Without any the search uses the
+    // default 30s + 0 game clock
+    typedef struct chess_limits
+    {
+        int depth;
+        int movetime; // ms
+        int wtime, btime, winc, binc;
+        int mate;     // moves, runs the mate search
+        int infinite; // until chess_engine_stop
+    } chess_limits;
+
+    // receives each info and bestmove line of a search, on the search thread
+    typedef void (*chess_line_callback)(const char *line, void *user_data);
+
+    // NULL if the hash table or the search threads couldn't be set up
+    CHESS_API chess_engine *chess_engine_create(void);
+    CHESS_API void chess_engine_destroy(chess_engine *engine);
+
+    // fen NULL or "startpos" for the starting position, moves in UCI
+    // notation separated by spaces, may be NULL. Returns 0, or -1 if the fen
+    // or a move is invalid or a search is running, in which case the
+    // position is unchanged
+    CHESS_API int chess_engine_set_position(chess_engine *engine,
+                                            const char *fen, const char *moves);
+    // the current position, returns the fen's length, writes at most size
+    // bytes with the terminating 0. Only valid while no search is running
+    CHESS_API size_t chess_engine_get_fen(chess_engine *engine, char *fen,
+                                          size_t size);
+    // same names and values as the UCI setoption, returns 0, or -1 if the
+    // option is unknown, name or value is NULL, a search is running or the
+    // Hash table of that many MB can't be allocated
+    CHESS_API int chess_engine_set_option(chess_engine *engine,
+                                          const char *name, const char *value);
+    // forget the hash table and move ordering statistics
+    CHESS_API void chess_engine_new_game(chess_engine *engine);
+
+    // searches until a limit is reached, returns the score in centipawns
+    // from the side to move's view and writes the best move in UCI notation,
+    // "0000" when there are no legal moves. callback may be NULL. If a
+    // search is running it writes "0000" and returns CHESS_ENGINE_BUSY
+    CHESS_API int chess_engine_search(chess_engine *engine,
+                                      const chess_limits *limits,
+                                      char bestmove[6],
+                                      chess_line_callback callback,
+                                      void *user_data);
+    // the same search, on the engine's thread. Returns -1 if one is running
+    CHESS_API int chess_engine_start(chess_engine *engine,
+                                     const chess_limits *limits,
+                                     chess_line_callback callback,
+                                     void *user_data);
+    // stop and wait return the score and best move of the started search
+    CHESS_API int chess_engine_stop(chess_engine *engine, char bestmove[6]);
+    CHESS_API int chess_engine_wait(chess_engine *engine, char bestmove[6]);
+    // until the started search is done with the engine, which is a little
+    // after its bestmove line
+    CHESS_API int chess_engine_is_searching(chess_engine *engine);
+
+    // these read the position, they're only valid while no search is running
+
+    // legal moves in UCI notation, separated by spaces. Returns their number,
+    // writes at most size bytes with the terminating 0
+    CHESS_API int chess_engine_legal_moves(chess_engine *engine, char *moves,
+                                           size_t size);
+    // whether the side to move is in check
+    CHESS_API int chess_engine_in_check(chess_engine *engine);
+    CHESS_API uint64_t chess_engine_perft(chess_engine *engine, int depth);
+    // static evaluation in centipawns, from white's view
+    CHESS_API int chess_engine_eval(chess_engine *engine);
+
+    // the UCI protocol on stdin and stdout, what the engine binary runs
+    CHESS_API int chess_engine_uci_main(int argc, char *argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,6 +1,11 @@
 #pragma GCC optimize("O3")
 #pragma GCC target("avx2")
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <cstring>
 #include <algorithm>
@@ -8,11 +13,14 @@
 #include <cassert>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <execution>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <random>
 #include <set>
 #include <sstream>
@@ -20,10 +28,64 @@
 #include <thread>
 #include <vector>
 #include <bits/stdc++.h>
+#include "chessengine.h"
 using namespace std;
 
 #define u_int64_t unsigned long long int
 
+// hot path profiler, compiled in with -DPROFILE, otherwise PROFILE_SCOPE is
+// empty. each scope adds its cycles (inclusive of nested scopes) and a call
+// to its section's thread local counter
+#ifdef PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+inline uint64_t profile_ticks() { return __rdtsc(); }
+#else
+inline uint64_t profile_ticks()
+{
+    return chrono::steady_clock::now().time_since_epoch().count();
+}
+#endif
+
+enum ProfileSection
+{
+    ProfileMovegen,
+    ProfileMakeMove,
+    ProfileUnmakeMove,
+    ProfileEval,
+    ProfileThreat,
+    ProfileZobrist,
+    ProfileTT,
+    ProfileSections
+};
+
+const char *profile_names[ProfileSections] = {
+    "generate_legal_moves2", "Board::make_move", "Board::unmake_move",
+    "Search::eval", "is_in_threat", "zobrist_hash", "TT probe/store"};
+
+struct ProfileCounter
+{
+    uint64_t calls = 0, ticks = 0;
+};
+thread_local ProfileCounter profile_counters[ProfileSections];
+
+struct ProfileTimer
+{
+    ProfileSection section;
+    uint64_t start;
+    ProfileTimer(ProfileSection _section)
+        : section(_section), start(profile_ticks()) {}
+    ~ProfileTimer()
+    {
+        profile_counters[section].calls++;
+        profile_counters[section].ticks += profile_ticks() - start;
+    }
+};
+#define PROFILE_SCOPE(section) ProfileTimer profile_timer(section)
+#else
+#define PROFILE_SCOPE(section)
+#endif
+
 enum Direction : char
 {
     EmptyDirection = 0,
@@ -124,7 +186,9 @@ enum MoveGenType
 };
 
 
+const uint64_t ZobristSeed = 0x5eed0fc4e55ba5e5;
 void zobrist_init();
+void cuckoo_init();
 
 class Move
 {
@@ -171,6 +235,8 @@ public:
     void print(string sq = "", bool flipped = false);
     void make_move(Move &move);
     void unmake_move(Move &move);
+    void make_null_move(Move &move);
+    void unmake_null_move(Move &move);
     bool load_fen(string fen);
     string to_fen();
     void load_startpos();
@@ -223,7 +289,8 @@ inline bool is_in_check(Board &board, Player turn)
         return is_in_threat<Black>(board.board, board.kpos);
 }
 
-int divide(Board &board, int depth);
+uint64_t perft(Board &board, int depth, bool last_move_check);
+uint64_t divide(Board &board, int depth);
 
 template <Player turn>
 vector<Move> generate_pseudo_moves(Board &board);
@@ -231,6 +298,7 @@ vector<Move> generate_pseudo_moves(Board &board);
 template <Player turn>
 vector<Move> generate_legal_moves(Board &board);
 vector<Move> generate_legal_moves(Board &board);
+void generate_legal_moves(Board &board, vector<Move> &movelist);
 
 // not accurate
 template <Player turn>
@@ -247,17 +315,190 @@ Move get_move_if_legal(Board &board, const string &move);
 
 string to_san(Board &board, Move move);
 
+Move get_move_from_san(Board &board, string san);
+
+bool see(Board &board, Move &move, int threshold);
+
 // search
+const int MateScore = 1e6;
+const int MAX_PLY = 128; // deepest ply the search can reach, extensions included
+
+// transposition table entry, 16 bytes. Threads and processes sharing a
+// table write entries without locks, the key is stored xored with the data
+// so a torn entry fails verification instead of giving another position's
+// data (Hyatt and Mann's lockless hashing). All zeros is an empty entry
 struct TTEntry
-{ // transposition table entry
-    uint64_t hash;
-    int age;
-    int depth = 0;
+{
+    atomic<uint64_t> key_xor_data{0};
+    atomic<uint64_t> data{0};
+};
+static_assert(sizeof(TTEntry) == 16 && atomic<uint64_t>::is_always_lock_free,
+              "TT entries are shared between processes");
+typedef TTEntry *TT_t;
+
+// what an entry holds, packed into its data word
+struct TTData
+{
+    uint16_t best_move; // see move_code()
     int score;
+    int depth;
     EvalType eval_type;
-    // Move best_move;
+    int age; // 1 + generation % 63 of the search that stored it, 0 if empty
 };
-typedef TTEntry *TT_t;
+
+// where a search's TT lives, which decides how it's cleared and freed
+enum TTStorage
+{
+    TTAllocated, // calloc, the search's own
+    TTBorrowed,  // another search's, lazy SMP helpers and server sessions
+    TTMapped,    // a shared memory segment, the other processes' too
+};
+
+// search trace, fixed size records in a memory mapped ring buffer file,
+// summarized offline by tools/trace_summary.cpp (keep the formats in sync)
+enum TraceNodeType : uint8_t
+{
+    TraceEarly,   // returned before searching moves: TT, pruning, draw
+    TracePV,      // exact score
+    TraceCut,     // fail high
+    TraceAll,     // fail low
+    TraceQuiesce, // quiescence node
+};
+
+struct TraceHeader
+{
+    char magic[8];        // "CHSTRACE"
+    uint32_t version;     // 1
+    uint32_t record_size; // sizeof(TraceRecord)
+    uint64_t capacity;    // records in the ring
+    uint64_t written;     // records written in total, the ring keeps the last
+};
+
+struct TraceRecord
+{
+    int32_t alpha, beta, score; // window on entry, returned score
+    uint32_t nodes;             // size of the subtree
+    uint16_t move;              // move_code of the move leading here
+    uint16_t best_move;         // cutoff or best move, 0 if none
+    uint8_t ply;
+    int8_t depth;               // quiescence nodes count down from 0
+    uint8_t type;               // TraceNodeType
+    uint8_t cutoff_index;       // 1-based number of the cutoff move, 0 if none
+    uint8_t researches;         // PVS and LMR re-searches of its children
+    uint8_t unused[3];
+};
+
+class Tracer
+{
+public:
+    int sample = 1;    // record one in this many nodes
+    int min_depth = 1; // skip nodes searched shallower, quiescence is <= 0
+
+    ~Tracer() { close(); }
+    bool open(const string &path, uint64_t capacity);
+    void close();
+    inline void record(const TraceRecord &record);
+    uint64_t written() { return header ? header->written : 0; }
+
+private:
+    TraceHeader *header = nullptr;
+    TraceRecord *records = nullptr;
+    size_t map_size = 0;
+    uint64_t counter = 0;
+};
+
+bool Tracer::open(const string &path, uint64_t capacity)
+{
+    close();
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    map_size = sizeof(TraceHeader) + capacity * sizeof(TraceRecord);
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, map_size) == 0)
+        map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping keeps the file open
+    if (map == MAP_FAILED)
+        return false;
+
+    header = (TraceHeader *)map;
+    records = (TraceRecord *)(header + 1);
+    memcpy(header->magic, "CHSTRACE", 8);
+    header->version = 1;
+    header->record_size = sizeof(TraceRecord);
+    header->capacity = capacity;
+    header->written = 0;
+    counter = 0;
+    return true;
+}
+
+void Tracer::close()
+{
+    if (!header)
+        return;
+    munmap(header, map_size);
+    header = nullptr;
+    records = nullptr;
+}
+
+inline void Tracer::record(const TraceRecord &record)
+{
+    if (record.depth < min_depth || ++counter % sample)
+        return;
+    records[header->written % header->capacity] = record;
+    header->written++;
+}
+
+// per ply state of a search, preallocated for the whole search
+struct SearchStack
+{
+    uint64_t key = 0;         // zobrist key of the position
+    int static_eval = 0;      // -MateScore when in check
+    uint16_t move = 0;        // move_code of the move made, 0 for a null move
+    uint16_t killers[2] = {}; // quiet moves that caused a cutoff
+    Move undo;                // the move made, it keeps the state to undo it
+    Move pv[MAX_PLY];         // triangular PV, the line from this ply onwards
+    int pv_length = 0;
+    vector<Move> moves;       // move list, its capacity is reused
+    vector<int> scores;
+
+    // what the node did, for the trace
+    TraceNodeType node_type = TraceEarly;
+    uint8_t cutoff_index = 0;
+    uint8_t researches = 0;
+    uint16_t best_move = 0;
+};
+
+// node of the proof-number mate search tree, children are stored together
+struct PNNode
+{
+    uint16_t move = 0;     // move_code of the move leading here
+    bool in_check = false; // side to move is in check
+    bool expanded = false;
+    int parent = -1;
+    int first_child = -1, children = 0;
+    uint32_t pn = 1, dn = 1; // proof and disproof numbers
+};
+static_assert(sizeof(PNNode) == 24, "mate_node_limit assumes 24 bytes a node");
+
+// counters of one search, cumulative over its iterations
+struct SearchStats
+{
+    int depth = 0, time = 0;
+    uint64_t nodes = 0, qnodes = 0;
+    uint64_t tt_probes = 0, tt_hits = 0;
+    uint64_t fail_highs = 0, first_move_fail_highs = 0;
+    Move bestmove; // of the iteration
+};
+
+struct RootMove
+{
+    int score = -MateScore; // exact for the best move, -MateScore if it failed low
+    Move move;
+    vector<Move> pv;
+};
+
+ostream null_stream(nullptr); // discards everything written to it
 
 class Search
 {
@@ -266,28 +507,218 @@ public:
     int wtime = 30000, btime = 30000, winc = 0, binc = 0;
     int mtime = 1000; // move time
     int max_depth = 100;
+    uint64_t max_nodes = 0; // go nodes, 0 for no limit
+    int max_time = INT_MAX; // ms, caps the time of every search type
     SearchType search_type = Time_per_game;
     atomic<bool> searching{false};
-    vector<uint64_t> repetitions; // for checking draw by repetition
+    atomic<bool> pondering{false}; // searching on the opponent's time
+    bool ponder = false;           // UCI Ponder option, the GUI decides
+    vector<uint64_t> repetitions; // keys of the game's positions before the root
+    bool upcoming_repetition = true; // cuckoo check for drawing moves
     TT_t TT;
-    int nodes_searched = 0;
+    uint64_t TT_mask; // entries - 1, the TT's size is a power of 2
+    int hash_mb;      // UCI Hash, the size of the TT
+    int generation = 0; // TT age, bumped on every search
+    int threads = 1;    // search threads, the main one included
+    int helper_id = 0;  // 0 for the main search, helpers are silent
+    // only its own thread writes nodes_searched, the main one sums them all
+    atomic<uint64_t> nodes_searched{0};
+    vector<Search *> helpers; // lazy SMP threads searching with us
+    Tracer *tracer = nullptr; // records alphabeta and quiesce nodes if set
+    SearchStats stats;
+    vector<SearchStats> iteration_stats; // stats after each iteration
+    vector<Move> pv; // of the move the last search chose
+    int seldepth = 0;
     int ply = 0;
     bool debug_mode = false;
-
-    string debug = "";
-
-    Search();
+    ostream *out = &cout; // where info and bestmove lines go
+
+    // selectivity, tunable through setoption, defaults repeated in spin_options
+    int null_move_min_depth = 3;
+    int null_move_reduction = 3;  // R, plus depth / 6
+    int lmr_min_depth = 3;
+    int lmr_min_moves = 3;        // moves searched at full depth first
+    int lmr_base = 75;            // reduction = base / 100 + ln(depth) * ln(moves) * 100 / divisor
+    int lmr_divisor = 225;
+    int rfp_max_depth = 6;        // reverse futility pruning
+    int rfp_margin = 100;         // per depth
+    int futility_max_depth = 3;
+    int futility_margin = 150;    // per depth
+    int aspiration_window = 50;
+    int multi_pv = 1;             // number of best lines to search and report
+    vector<Move> search_moves;    // go searchmoves, the root moves to consider
+    int mate_moves = 0;           // go mate, the mate to prove in moves
+    int mate_node_limit = 1 << 22; // mate search tree size, 24 bytes a node
+    int reductions[64][64];
+
+    Search(TT_t shared_TT = nullptr, int hash_mb = 1);
+    ~Search();
     pair<Move, int> search();
+    bool set_mapped_hash(const string &name, bool file, string &error);
+    void set_hash_size(int mb);
+    void ponderhit();
+    void new_game();
+    void init_reductions();
     void set_clock(int _wtime, int _btime, int _winc, int _binc);
     template <bool debug>
     int eval();
-    bool is_repetition();
+    bool is_repetition(uint64_t hash);
+    bool has_upcoming_repetition(uint64_t hash);
 
 protected:
+    // time management
+    chrono::high_resolution_clock::time_point start_time;
+    // only the search thread touches the clock, ponderhit just raises the
+    // flag and check_time starts the clock
+    int max_search_time = INT_MAX; // ms
+    int clock_start = 0;           // ms into the search our clock started
+    int budget = INT_MAX;          // time_budget() of the search's position
+    atomic<bool> ponder_hit{false};
+    int root_moves = 0;
+    int time_budget();
+
+    TTStorage TT_storage = TTAllocated;
+    vector<SearchStack> stack; // indexed by ply
+    vector<Move> mobility_moves; // scratch move list for eval
+
+    // quiet move ordering, moves are stored as move_code()s
+    int history[2][64][64];        // [side][from][to] cutoff statistics
+    uint16_t countermoves[64][64]; // [from][to] of the previous move
+
     int negamax(int depth);
-    int alphabeta(int depth, int alpha, int beta);
+    int alphabeta(int depth, int alpha, int beta, bool null_ok = true);
+    int alphabeta_node(int depth, int alpha, int beta, bool null_ok);
     int quiesce(int depth, int alpha, int beta);
-    vector<pair<int, Move>> iterative_search();
+    int quiesce_node(int depth, int alpha, int beta);
+    void trace(int depth, int alpha, int beta, int score, uint64_t nodes);
+    int root_search(vector<RootMove> &rootmoves, size_t first, int depth,
+                    int alpha, int beta);
+    vector<RootMove> iterative_search();
+    pair<Move, int> mate_search();
+    void pn_expand(vector<PNNode> &tree, int n, int ply);
+    void score_moves(vector<Move> &moves, vector<int> &scores, uint16_t TT_move);
+    void update_pv(Move &move);
+    void make_move(Move &move);
+    void unmake_move();
+    void make_null_move();
+    void unmake_null_move();
+    uint64_t key_back(int plies);
+    void update_quiet_stats(uint16_t move, uint16_t *quiets, int quiets_n,
+                            int depth);
+    void check_time();
+    int time_elapsed();
+    inline void count_node();
+    uint64_t total_nodes();
+    void print_info(string infostring, int depth, int score, string pv);
+
+public:
+    void print_stats(ostream &out);
+};
+
+// threads created once and parked on a condition variable until they're
+// given a job, so go doesn't pay for thread creation
+class ThreadPool
+{
+public:
+    ThreadPool(int n) { resize(n); }
+    ~ThreadPool() { resize(0); }
+    int size() { return workers.size(); }
+    void resize(int n);
+    void run(int i, function<void()> job); // thread i must be idle
+    void wait();                           // until all threads are idle
+
+private:
+    struct Worker
+    {
+        thread th;
+        function<void()> job;
+        bool quit = false;
+    };
+    vector<unique_ptr<Worker>> workers;
+    mutex m;
+    condition_variable wakeup, idle;
+    void loop(Worker &worker);
+};
+
+// a streambuf handing each line written to it to a callback, so the info
+// and bestmove lines of an in-process search can go anywhere
+class LineCallbackBuf : public streambuf
+{
+public:
+    function<void(const string &)> callback;
+
+protected:
+    int overflow(int c) override;
+
+private:
+    string line;
+};
+
+// analysis cache: the results of finished searches by position, so a go
+// that an earlier search already answered returns at once. The least
+// recently used results are dropped from memory, all of them are appended to
+// a log file that is replayed when the cache is opened again
+struct CachedAnalysis
+{
+    uint64_t key = 0; // analysis_key(), the position and its game history
+    string fen;       // the first four fields, to tell key collisions apart
+    int depth = 0, score = 0;
+    int time = 0; // ms the result stands for, the movetime if it used it all
+    uint64_t nodes = 0;
+    vector<string> pv; // UCI moves, the best move first
+};
+
+class AnalysisCache
+{
+public:
+    size_t capacity = 100000; // results kept in memory
+    uint64_t hits = 0, misses = 0, stores = 0, evictions = 0;
+
+    bool open(const string &path); // "" for a cache without a log
+    void close();
+    bool enabled() { return on; }
+    // a result searched to depth or for time ms, whichever isn't 0
+    bool lookup(uint64_t key, const string &fen, int depth, int time,
+                CachedAnalysis &analysis);
+    void store(const CachedAnalysis &analysis);
+    void print_stats(ostream &out);
+
+private:
+    bool on = false;
+    mutex m; // the search thread stores, the UCI thread looks up
+    list<CachedAnalysis> lru; // most recently used first
+    unordered_map<uint64_t, list<CachedAnalysis>::iterator> index;
+    ofstream log;
+    void insert(const CachedAnalysis &analysis);
+};
+
+// the engine in this process: a search, its helper threads and the TT, which
+// survives between searches. The callback gets the info and bestmove lines on
+// the search thread, without one they go to cout
+class Engine
+{
+public:
+    Search ai;
+    pair<Move, int> result; // of the last finished search
+
+    Engine();
+    ~Engine();
+    void set_threads(int n);
+    void start(function<void(const string &)> on_line = nullptr);
+    void run(function<void()> job); // on the search thread, e.g. perft
+    void stop();                    // and wait for the bestmove
+    void wait();                    // until the search finishes on its own
+    // until the job is done, the bestmove is written after the search ends
+    bool searching() { return busy; }
+    AnalysisCache cache;
+
+private:
+    ThreadPool pool;
+    atomic<bool> busy{false}; // a job of start or run is queued or running
+    bool stop_requested = false;
+    vector<unique_ptr<Search>> helpers;
+    LineCallbackBuf lines;
+    ostream line_stream;
 };
 
 // game
@@ -301,6 +732,7 @@ public:
     DrawType draw_type = None;
     int material_count[13] = {0};
     vector<uint64_t> repetitions;
+    unique_ptr<Engine> engine; // created by the first ai_move
 
     Game();
     bool make_move(string m);
@@ -445,6 +877,17 @@ namespace Zobrist
     uint64_t enpassant[8]; // enpassant file
 } // namespace Zobrist
 
+// cuckoo tables of the zobrist differences of all reversible piece moves,
+// for detecting a move that repeats an earlier position (Marcel van Kervinck)
+namespace Cuckoo
+{
+    const int size = 8192;
+    uint64_t keys[size];  // pst[from][p] ^ pst[to][p] ^ turn, 0 if empty
+    uint16_t moves[size]; // from | to << 6, from < to
+    inline int h1(uint64_t key) { return key & (size - 1); }
+    inline int h2(uint64_t key) { return (key >> 16) & (size - 1); }
+} // namespace Cuckoo
+
 int sq2idx(char file, char rank)
 {
     return (file - 'a') + (7 - (rank - '1')) * 8; // matrix magic
@@ -541,6 +984,7 @@ void Board::print(string sq, bool flipped)
 
 void Board::make_move(Move &move)
 {
+    PROFILE_SCOPE(ProfileMakeMove);
     // save current aspects
     copy_n(castling_rights, 4, move.castling_rights);
     move.enpassant_sq_idx = enpassant_sq_idx;
@@ -620,6 +1064,7 @@ void Board::make_move(Move &move)
 }
 void Board::unmake_move(Move &move)
 {
+    PROFILE_SCOPE(ProfileUnmakeMove);
     // restore current aspects
     copy_n(move.castling_rights, 4, castling_rights);
     enpassant_sq_idx = move.enpassant_sq_idx;
@@ -659,6 +1104,24 @@ void Board::unmake_move(Move &move)
     moves--;
 }
 
+// pass the turn, move only saves the aspects to restore
+void Board::make_null_move(Move &move)
+{
+    move.enpassant_sq_idx = enpassant_sq_idx;
+    move.fifty = fifty;
+    enpassant_sq_idx = -1;
+    fifty = 0; // nothing before a null move can repeat
+    change_turn();
+    moves++;
+}
+void Board::unmake_null_move(Move &move)
+{
+    enpassant_sq_idx = move.enpassant_sq_idx;
+    fifty = move.fifty;
+    change_turn();
+    moves--;
+}
+
 bool Board::load_fen(string fen)
 {
     fill_n(board, 64, Empty);
@@ -678,8 +1141,12 @@ bool Board::load_fen(string fen)
             if (p > 63)
                 return false;
             if (isdigit(x))
+            {
+                if (p + x - '0' > 64)
+                    return false;
                 for (int dots = x - '0'; dots--;)
                     board[p++] = Empty;
+            }
             else if (x != '/')
                 board[p++] = char2piece(x);
         }
@@ -791,6 +1258,7 @@ void Board::load_startpos()
 
 uint64_t Board::zobrist_hash()
 {
+    PROFILE_SCOPE(ProfileZobrist);
     uint64_t hash = 0;
     for (int i = 0; i < 64; i++)
         if (board[i] != Empty)
@@ -807,11 +1275,13 @@ uint64_t Board::zobrist_hash()
 
 void zobrist_init()
 {
-    random_device rd;
+    // a fixed seed, hash tables shared with other processes or saved need
+    // the same keys
+    mt19937_64 rd(ZobristSeed);
     uniform_int_distribution<uint64_t> uni(0, UINT64_MAX);
 
     for (int i = 0; i < 64; i++)     // squares
-        for (int j = 0; j < 12; j++) // pieces
+        for (int j = 0; j < 13; j++) // pieces, 6 (empty) is never used
             Zobrist::pst[i][j] = uni(rd);
 
     for (int i = 0; i < 4; i++) // castling rights
@@ -823,6 +1293,65 @@ void zobrist_init()
         Zobrist::enpassant[i] = uni(rd);
 }
 
+// squares a piece attacks from sq on an empty board
+vector<int> empty_board_attacks(Piece piece, int sq)
+{
+    static const int king[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1},
+                                   {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+    static const int knight[8][2] = {{-2, -1}, {-2, 1}, {-1, -2}, {-1, 2},
+                                     {1, -2}, {1, 2}, {2, -1}, {2, 1}};
+    const int type = abs(piece);
+    const bool slider = type == wB || type == wR || type == wQ;
+    vector<int> attacks;
+    for (int d = 0; d < 8; d++)
+    {
+        const int *delta = type == wN ? knight[d] : king[d];
+        const bool diagonal = delta[0] && delta[1];
+        if ((type == wB && !diagonal) || (type == wR && diagonal))
+            continue;
+        int row = sq / 8 + delta[0], col = sq % 8 + delta[1];
+        while (row >= 0 && row < 8 && col >= 0 && col < 8)
+        {
+            attacks.push_back(row * 8 + col);
+            if (!slider)
+                break;
+            row += delta[0], col += delta[1];
+        }
+    }
+    return attacks;
+}
+
+void cuckoo_init()
+{
+    int count = 0;
+    for (int piece = bK; piece <= wK; piece++)
+    {
+        if (piece == Empty || abs(piece) == wP)
+            continue;
+        for (int from = 0; from < 64; from++)
+            for (int to : empty_board_attacks(Piece(piece), from))
+            {
+                if (to < from)
+                    continue;
+                uint16_t move = from | to << 6;
+                uint64_t key = Zobrist::pst[from][piece + 6] ^
+                               Zobrist::pst[to][piece + 6] ^ Zobrist::turn;
+                // insert, kicking out entries into their other slot
+                int i = Cuckoo::h1(key);
+                while (true)
+                {
+                    swap(Cuckoo::keys[i], key);
+                    swap(Cuckoo::moves[i], move);
+                    if (!move)
+                        break;
+                    i = i == Cuckoo::h1(key) ? Cuckoo::h2(key) : Cuckoo::h1(key);
+                }
+                count++;
+            }
+    }
+    assert(count == 3668);
+}
+
 Game::Game() { new_game(); }
 
 bool Game::make_move(string m) { return make_move_if_legal(board, m); }
@@ -869,8 +1398,8 @@ void Game::next()
         return;
     // if (board[movelist[ply].to]) material_count[board[movelist[ply].to] + 6]--;
     // movelist[ply].print();
-    board.make_move(movelist[ply++]);
     repetitions.push_back(board.zobrist_hash());
+    board.make_move(movelist[ply++]);
     result = get_result();
 }
 
@@ -931,58 +1460,24 @@ Move Game::random_move()
     return bestmove;
 }
 
+// searches in this process, the engine and its TT are kept for the next move
 pair<Move, int> Game::ai_move(int time)
 {
-    pair<Move, int> ai_move;
-    string input;
-    input.reserve(1000);
-
-    for (auto &m : movelist)
-    {
-        input += m.to_uci() + " ";
-    }
-
-    // write to a file
-    ofstream file;
-    file.open("tempConnection");
-    file << "uci" << "\n";
-    file << "position startpos moves " << input << "\n";
-    file << "go movetime " + to_string(time) << "\n";
-    file.close();
-
-    cout << ">>> position startpos moves " << input << "\n";
-
-#pragma GCC diagnostic ignored "-Wunused-result"
-
-    // run the engine
-    string engine_path = "./main";
-    string cmd = engine_path + " < tempConnection > tempConnection2";
-    system(cmd.c_str());
-
-    // read the output
-    ifstream file2;
-    file2.open("tempConnection2");
-    string output;
-    while (getline(file2, output))
-    {
-        cout << output << "\n";
-        if (output.size() > 8)
-        {
-            if (output.substr(0, 8) == "bestmove")
-            {
-                // cout << "[" << output.substr(9, 4) << "]" << "\n";
-                string move = output.substr(9, 4);
-                ai_move.first = get_move_if_legal(board, move);
-                break;
-            }
-        }
-    }
-    file2.close();
-
-    // cleanup
-    system("rm tempConnection tempConnection2");
-
-    return ai_move;
+    if (!engine)
+        engine = make_unique<Engine>();
+    auto &ai = engine->ai;
+    ai.board = board;
+    ai.repetitions = repetitions;
+    ai.search_moves.clear();
+    ai.pondering = false;
+    ai.search_type = Time_per_move;
+    ai.mtime = time;
+
+    cout << ">>> position fen " << board.to_fen() << "\n";
+    engine->start([](const string &line)
+                  { cout << line << "\n"; });
+    engine->wait();
+    return engine->result;
 }
 
 Status Game::get_result()
@@ -1342,12 +1837,118 @@ bool is_sq_attacked_by_KBRQ2(Position &pos, int sq)
 template <Player turn>
 bool is_in_threat(Position &pos, int sq)
 {
+    PROFILE_SCOPE(ProfileThreat);
     // generate and check reverse threats from sq
     return is_sq_attacked_by_P<turn>(pos, sq) ||
            is_sq_attacked_by_N<turn>(pos, sq) ||
            is_sq_attacked_by_KBRQ<turn>(pos, sq);
 }
 
+// least valuable piece of `side` attacking sq, -1 if there is none
+// see() removes pieces as they capture, so sliders hiding behind them
+// (x-ray attackers) are found by the next call
+template <Player side>
+int least_valuable_attacker(Position &pos, int sq)
+{
+    constexpr Piece P = Piece(side * wP);
+    constexpr Piece Kn = Piece(side * wN);
+    constexpr Piece B = Piece(side * wB);
+    constexpr Piece R = Piece(side * wR);
+    constexpr Piece Q = Piece(side * wQ);
+    constexpr Piece K = Piece(side * wK);
+    // a pawn attacks sq from one rank behind it (relative to side)
+    constexpr Direction behind_W = side == White ? SW : NW;
+    constexpr Direction behind_E = side == White ? SE : NE;
+
+    if (is_occupied<behind_W, P>(pos, sq))
+        return sq + behind_W;
+    if (is_occupied<behind_E, P>(pos, sq))
+        return sq + behind_E;
+
+#define check(dir)                    \
+    if (is_occupied<dir, Kn>(pos, sq)) \
+        return sq + dir;
+    check(NNW) check(NNE);
+    check(WNW) check(WSW);
+    check(ENE) check(ESE);
+    check(SSW) check(SSE);
+#undef check
+
+    // first piece on every ray, diagonals first
+    const int blockers[8] = {
+        slide_find_end<NW>(pos, sq), slide_find_end<NE>(pos, sq),
+        slide_find_end<SW>(pos, sq), slide_find_end<SE>(pos, sq),
+        slide_find_end<N>(pos, sq), slide_find_end<S>(pos, sq),
+        slide_find_end<E>(pos, sq), slide_find_end<W>(pos, sq)};
+    for (int i = 0; i < 4; i++)
+        if (~blockers[i] && pos[blockers[i]] == B)
+            return blockers[i];
+    for (int i = 4; i < 8; i++)
+        if (~blockers[i] && pos[blockers[i]] == R)
+            return blockers[i];
+    for (int i = 0; i < 8; i++)
+        if (~blockers[i] && pos[blockers[i]] == Q)
+            return blockers[i];
+
+#define check(dir)                   \
+    if (is_occupied<dir, K>(pos, sq)) \
+        return sq + dir;
+    check(NE) check(NW) check(SE) check(SW);
+    check(N) check(S) check(E) check(W);
+#undef check
+    return -1;
+}
+
+// static exchange evaluation
+// true if the capture sequence on move.to started by move, with both sides
+// recapturing with their least valuable piece, gains at least threshold
+bool see(Board &board, Move &move, int threshold)
+{
+    if (move.castling)
+        return 0 >= threshold;
+
+    Position pos;
+    copy_n(board.board, 64, pos);
+    const int sq = move.to;
+    auto value = [](Piece p)
+    { return abs(piece_val[p + 6]); };
+
+    int gain[32], d = 0;
+    Piece on_sq = pos[move.from]; // piece that will be captured next
+    gain[0] = move.enpassant ? value(wP) : value(pos[sq]);
+    if (move.promotion != Empty)
+    {
+        gain[0] += value(move.promotion) - value(wP);
+        on_sq = move.promotion;
+    }
+    pos[move.from] = Empty;
+    if (move.enpassant)
+        pos[sq + (board.turn == White ? S : N)] = Empty;
+
+    Player side = Player(-board.turn);
+    while (d < 31)
+    {
+        const int from = side == White ? least_valuable_attacker<White>(pos, sq)
+                                       : least_valuable_attacker<Black>(pos, sq);
+        if (from < 0)
+            break;
+        d++;
+        gain[d] = value(on_sq) - gain[d - 1]; // if it isn't recaptured
+        if (max(-gain[d - 1], gain[d]) < 0)
+            break; // neither side can come out ahead by continuing
+        on_sq = pos[from];
+        pos[from] = Empty;
+        side = Player(-side);
+    }
+    // each side may stop capturing whenever continuing would lose material
+    while (d > 0)
+    {
+        gain[d - 1] = -max(-gain[d - 1], gain[d]);
+        d--;
+    }
+    return gain[0] >= threshold;
+}
+
 template <Direction dir>
 void jump(Position &pos, vector<Move> &movelist, int sq)
 {
@@ -1804,11 +2405,12 @@ void generate_castling_moves_safe(Board &board, vector<Move> &movelist)
 #undef US
 }
 
+// fills movelist, so the caller can reuse its capacity
 template <Player turn, MoveGenType type>
-vector<Move> generate_legal_moves2(Board &board)
+void generate_legal_moves2(Board &board, vector<Move> &movelist)
 {
-    vector<Move> movelist;
-    movelist.reserve(30); // average number of legal moves per position
+    PROFILE_SCOPE(ProfileMovegen);
+    movelist.clear();
 
     constexpr Piece rel_P = Piece(wP * turn);
     constexpr Piece rel_N = Piece(wN * turn);
@@ -2098,6 +2700,14 @@ vector<Move> generate_legal_moves2(Board &board)
         }
     }
 #undef is_intermediate_sq
+}
+
+template <Player turn, MoveGenType type>
+vector<Move> generate_legal_moves2(Board &board)
+{
+    vector<Move> movelist;
+    movelist.reserve(30); // average number of legal moves per position
+    generate_legal_moves2<turn, type>(board, movelist);
     return movelist;
 }
 
@@ -2154,7 +2764,24 @@ vector<Move> generate_legal_moves(Board &board)
         return generate_legal_moves<Black>(board);
 }
 
-int perft(Board &board, int depth, bool last_move_check)
+template <Player turn>
+void generate_legal_moves(Board &board, vector<Move> &movelist)
+{
+    if (is_in_check<turn>(board))
+        generate_legal_moves2<turn, Evasions>(board, movelist);
+    else
+        generate_legal_moves2<turn, NonEvasions>(board, movelist);
+}
+
+void generate_legal_moves(Board &board, vector<Move> &movelist)
+{
+    if (board.turn == White)
+        generate_legal_moves<White>(board, movelist);
+    else
+        generate_legal_moves<Black>(board, movelist);
+}
+
+uint64_t perft(Board &board, int depth, bool last_move_check)
 {
     if (depth <= 0)
         return 1;
@@ -2165,7 +2792,7 @@ int perft(Board &board, int depth, bool last_move_check)
     if (depth == 1)
         return legal.size();
 
-    int nodes = 0;
+    uint64_t nodes = 0;
 
     for (auto &move : legal)
     {
@@ -2180,9 +2807,9 @@ int perft(Board &board, int depth, bool last_move_check)
     return nodes;
 }
 
-int divide(Board &board, int depth)
+uint64_t divide(Board &board, int depth)
 {
-    int sum = 0;
+    uint64_t sum = 0;
     auto t1 = chrono::high_resolution_clock::now();
     auto legal = generate_legal_moves(board);
     // Board before = board;
@@ -2194,7 +2821,7 @@ int divide(Board &board, int depth)
         //                                  : is_in_check<Black>(board);
         bool check = board.turn == White ? is_check<White>(board, move)
                                          : is_check<Black>(board, move);
-        int nodes = perft(board, depth - 1, check);
+        uint64_t nodes = perft(board, depth - 1, check);
         board.unmake_move(move);
         // if (before.to_fen() != board.to_fen()) {
         //   cerr << "! "
@@ -2214,7 +2841,7 @@ int divide(Board &board, int depth)
 
     cout << "Moves: " << legal.size() << "\n";
     cout << "Nodes: " << sum << "\n";
-    cout << "Nodes/sec: " << int(diff ? sum * 1e9 / diff : -1) << "\n";
+    cout << "Nodes/sec: " << (long long)(diff ? sum * 1e9 / diff : -1) << "\n";
     return sum;
 }
 
@@ -2318,111 +2945,567 @@ string to_san(Board &board, Move move)
     return san;
 }
 
-const int MateScore = 1e6;
-const int TT_miss = 404000;
-int TT_size = 1 << 16; //16Mb
-
-void init_TT(TT_t &TT, int size)
+// the legal move written in SAN, e.g. Nbd7, exd6, e8=Q+ or O-O, as found in
+// EPD files, or in UCI notation. Move() if it's illegal or ambiguous
+Move get_move_from_san(Board &board, string san)
 {
-    // get next power of 2
-    int n = 1;
-    while (n < size)
-        n <<= 1;
-    TT_size = n;
-
-    // allocate memory, half the size if fails
-    do
-        TT = new (nothrow) TTEntry[TT_size];
-    while (!TT && (TT_size >>= 1));
+    // check marks and annotations don't tell the move apart
+    while (san.size() && strchr("+#!?", san.back()))
+        san.pop_back();
+    if (san == "O-O" || san == "0-0" || san == "O-O-O" || san == "0-0-0")
+    {
+        const bool long_castle = san.size() == 5;
+        for (auto &move : generate_legal_moves(board))
+            if (move.castling && (move.to % 8 == 2) == long_castle)
+                return move;
+        return Move();
+    }
+    auto is_square = [&](size_t i)
+    {
+        return i + 1 < san.size() && san[i] >= 'a' && san[i] <= 'h' &&
+               san[i + 1] >= '1' && san[i + 1] <= '8';
+    };
+    if ((san.size() == 4 || san.size() == 5) && is_square(0) && is_square(2))
+    {
+        Move move = get_move_if_legal(board, san);
+        if (!move.equals(0, 0))
+            return move;
+    }
 
-    for (int i = 0; i < TT_size; i++)
+    char piece = 'P', promotion = 0;
+    if (san.size() && strchr("NBRQK", san[0]))
+    {
+        piece = san[0];
+        san.erase(0, 1);
+    }
+    if (san.size() && strchr("NBRQnbrq", san.back()) && san.size() > 2)
+    {
+        promotion = toupper(san.back());
+        san.pop_back();
+        if (san.back() == '=')
+            san.pop_back();
+    }
+    if (san.size() < 2 || !is_square(san.size() - 2))
+        return Move();
+    const string target = san.substr(san.size() - 2);
+    // what's left is the origin's file and/or rank, and the capture
+    string origin = san.substr(0, san.size() - 2);
+    origin.erase(remove(origin.begin(), origin.end(), 'x'), origin.end());
+
+    Move found;
+    int matches = 0;
+    for (auto &move : generate_legal_moves(board))
     {
-        TT[i].age = -1;
-        TT[i].depth = 0;
+        const string from = idx2sq(move.from);
+        if (toupper(piece2char(board[move.from])) == piece &&
+            idx2sq(move.to) == target &&
+            (move.promotion == Empty ? 0 : toupper(piece2char(move.promotion))) ==
+                promotion &&
+            all_of(origin.begin(), origin.end(), [&](char c)
+                   { return c == from[0] || c == from[1]; }))
+        {
+            found = move;
+            matches++;
+        }
     }
+    return matches == 1 ? found : Move();
 }
 
-int normalize_score(int score, int depth)
+const int TT_miss = 404000;
+const int TT_max_mb = 1 << 16;
+
+// every table has this header in front of its entries, searches sharing a
+// table read its size from it. A shared table is a segment, processes only
+// use it if they agree on its layout and Zobrist keys
+struct TTSegmentHeader
 {
-    if (score > MateScore)
-        return score - depth;
-    if (score < -MateScore)
-        return score + depth;
-    return score;
-}
+    char magic[8]; // "CHSHASH"
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t entries;
+    uint64_t zobrist_seed;
+    atomic<uint32_t> ready; // set by the creator once the header is written
+};
 
-inline int TT_probe(TT_t TT, u_int64_t hash, int depth, int alpha, int beta)
+inline TTSegmentHeader *TT_header(TT_t TT) { return (TTSegmentHeader *)TT - 1; }
+
+inline uint64_t TT_entries(TT_t TT) { return TT_header(TT)->entries; }
+
+// the most entries that fit in mb, a power of 2 so keys index with a mask
+uint64_t TT_entries_for(int mb)
 {
-    TT_t entry = &TT[hash % TT_size];
-    if (entry->hash != hash)
-        return TT_miss; // verify hash
-    if (entry->age > 0 && entry->depth >= depth)
-    {
-        int score = normalize_score(entry->score, depth);
-        if (entry->eval_type == Exact)
-            return score;
-        if (entry->eval_type == LowerBound && score >= beta)
-            return beta;
-        if (entry->eval_type == UpperBound && score <= alpha)
-            return alpha;
-    }
-    return TT_miss;
+    const uint64_t entries =
+        (uint64_t(max(1, min(mb, TT_max_mb))) << 20) / sizeof(TTEntry);
+    return uint64_t(1) << (63 - __builtin_clzll(entries));
 }
 
-inline void TT_store(TT_t TT, u_int64_t hash, int depth, int score,
-                     EvalType eval_type)
+size_t TT_bytes(uint64_t entries)
 {
-    TT_t entry = &TT[hash % TT_size];
-    if (entry->depth > depth)
-        return; // don't overwrite deeper scores
-    entry->age = 1;
-    entry->hash = hash;
-    entry->depth = depth;
-    entry->score = normalize_score(score, depth);
-    entry->eval_type = eval_type;
+    return sizeof(TTSegmentHeader) + sizeof(TTEntry) * entries;
 }
 
-Search::Search()
+// throws bad_alloc. The entries start empty, calloc zero fills
+void init_TT(TT_t &TT, uint64_t entries)
 {
-    init_TT(TT, TT_size);
+    auto *header = (TTSegmentHeader *)calloc(1, TT_bytes(entries));
+    if (!header)
+        throw bad_alloc();
+    header->entries = entries;
+    TT = (TT_t)(header + 1);
 }
 
-void Search::set_clock(int _wtime, int _btime, int _winc, int _binc)
+void clear_TT(TT_t TT)
 {
-    wtime = _wtime;
-    btime = _btime;
-    winc = _winc;
-    binc = _binc;
+    const uint64_t entries = TT_entries(TT);
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        TT[i].key_xor_data.store(0, memory_order_relaxed);
+        TT[i].data.store(0, memory_order_relaxed);
+    }
 }
 
-pair<Move, int> Search::search()
-{
-    searching = true;
-    auto movelist = iterative_search();
-    searching = false;
+inline int TT_age(int generation) { return 1 + generation % 63; }
 
-    auto bestmove = movelist.front().second;
-    auto bestscore = movelist.front().first;
+inline uint64_t TT_pack(const TTData &d)
+{
+    return uint64_t(d.best_move) | uint64_t(uint32_t(d.score)) << 16 |
+           uint64_t(uint8_t(d.depth)) << 48 | uint64_t(d.eval_type) << 56 |
+           uint64_t(d.age) << 58;
+}
 
-    // choose random move out of same-scoring moves
-    vector<pair<int, Move>> bestmoves;
-    for (auto &score_move : movelist)
-        if (score_move.first == bestscore)
-            bestmoves.emplace_back(score_move);
+inline TTData TT_unpack(uint64_t data)
+{
+    return {uint16_t(data), int32_t(data >> 16), int8_t(data >> 48),
+            EvalType(data >> 56 & 3), int(data >> 58)};
+}
 
-    if (bestmoves.size() > 1)
+// maps the named POSIX shared memory segment, or the file if file is set,
+// creating it with entries if it doesn't exist, nullptr on failure or if
+// it has another size. Segments stay until removed from /dev/shm, a file
+// keeps the table across restarts
+TT_t map_TT(const string &name, bool file, uint64_t entries, string &error)
+{
+    const size_t segment_size = TT_bytes(entries);
+    auto open_segment = [&](int flags)
     {
-        random_device rd;
-        uniform_int_distribution<int> dist(0, bestmoves.size() - 1);
-        auto &best = bestmoves[dist(rd)];
-        bestmove = best.second;
-        bestscore = best.first;
+        return file ? open(name.c_str(), flags, 0644)
+                    : shm_open(name.c_str(), flags, 0600);
+    };
+    int fd = open_segment(O_RDWR | O_CREAT | O_EXCL);
+    const bool created = fd >= 0;
+    if (!created)
+        fd = open_segment(O_RDWR);
+    if (fd < 0)
+    {
+        error = "can't open " + name + ": " + strerror(errno);
+        return nullptr;
+    }
+    if (created && ftruncate(fd, segment_size) < 0)
+    {
+        error = "can't size " + name + ": " + strerror(errno);
+        close(fd);
+        file ? unlink(name.c_str()) : shm_unlink(name.c_str());
+        return nullptr;
+    }
+    // the creator may not have sized it yet
+    struct stat st;
+    for (int i = 0; i < 1000 && !fstat(fd, &st) && st.st_size == 0; i++)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) != segment_size)
+    {
+        error = name + " is a hash of another size";
+        close(fd);
+        return nullptr;
+    }
+    void *map = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        error = "can't map " + name + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    // ftruncate zero fills, so the entries start empty
+    auto *header = (TTSegmentHeader *)map;
+    if (created)
+    {
+        memcpy(header->magic, "CHSHASH", 8);
+        header->version = 1;
+        header->entry_size = sizeof(TTEntry);
+        header->entries = entries;
+        header->zobrist_seed = ZobristSeed;
+        header->ready.store(1, memory_order_release);
+    }
+    for (int i = 0; i < 1000 && !header->ready.load(memory_order_acquire); i++)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    if (!header->ready.load(memory_order_acquire) ||
+        memcmp(header->magic, "CHSHASH", 8) || header->version != 1 ||
+        header->entry_size != sizeof(TTEntry) || header->entries != entries ||
+        header->zobrist_seed != ZobristSeed)
+    {
+        error = name + " isn't a compatible hash";
+        munmap(map, segment_size);
+        return nullptr;
+    }
+    return (TT_t)(header + 1);
+}
+
+void free_TT(TT_t TT, TTStorage storage)
+{
+    if (!TT)
+        return;
+    if (storage == TTAllocated)
+        free(TT_header(TT));
+    else if (storage == TTMapped)
+        munmap(TT_header(TT), TT_bytes(TT_entries(TT)));
+}
+
+// savehash files: this header, then the key and the data word of each saved
+// entry. The keys are only valid with the Zobrist keys of the same seed
+struct HashFileHeader
+{
+    char magic[8]; // "CHSAVED"
+    uint32_t version;
+    uint32_t min_depth;
+    uint64_t zobrist_seed;
+    uint64_t entries;
+};
+
+// writes the entries searched to at least min_depth, false on failure
+bool save_TT(TT_t TT, const string &path, int min_depth, uint64_t &saved,
+             string &error)
+{
+    vector<uint64_t> words;
+    const uint64_t entries = TT_entries(TT);
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        const uint64_t data = TT[i].data.load(memory_order_relaxed);
+        const uint64_t key = TT[i].key_xor_data.load(memory_order_relaxed) ^ data;
+        if (data && (key & (entries - 1)) == i &&
+            TT_unpack(data).depth >= min_depth)
+        {
+            words.push_back(key);
+            words.push_back(data);
+        }
+    }
+    HashFileHeader header = {};
+    memcpy(header.magic, "CHSAVED", 8);
+    header.version = 1;
+    header.min_depth = min_depth;
+    header.zobrist_seed = ZobristSeed;
+    header.entries = saved = words.size() / 2;
+
+    ofstream file(path, ios::binary | ios::trunc);
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)words.data(), words.size() * sizeof(uint64_t));
+    if (!file)
+        error = "can't write " + path;
+    return bool(file);
+}
+
+// merges a savehash file into TT, a loaded entry replaces a shallower one.
+// Entries go where their key puts them, so TT's size needn't be the saver's
+bool load_TT(TT_t TT, const string &path, uint64_t &loaded, string &error)
+{
+    const uint64_t mask = TT_entries(TT) - 1;
+    ifstream file(path, ios::binary);
+    HashFileHeader header;
+    if (!file.read((char *)&header, sizeof(header)) ||
+        memcmp(header.magic, "CHSAVED", 8) || header.version != 1)
+    {
+        error = path + " isn't a saved hash";
+        return false;
+    }
+    if (header.zobrist_seed != ZobristSeed)
+    {
+        error = path + " was saved with other Zobrist keys";
+        return false;
+    }
+    loaded = 0;
+    uint64_t record[2];
+    for (uint64_t i = 0; i < header.entries && file.read((char *)record, sizeof(record)); i++)
+    {
+        const auto [key, data] = record;
+        TT_t entry = &TT[key & mask];
+        const uint64_t old = entry->data.load(memory_order_relaxed);
+        if (old && TT_unpack(old).depth > TT_unpack(data).depth)
+            continue;
+        entry->key_xor_data.store(key ^ data, memory_order_relaxed);
+        entry->data.store(data, memory_order_relaxed);
+        loaded++;
+    }
+    if (file.fail())
+    {
+        error = path + " is truncated";
+        return false;
+    }
+    return true;
+}
+
+// mate scores are stored relative to the node, not the root, so they stay
+// valid wherever the position is reached again
+int normalize_score(int score, int ply)
+{
+    if (score > MateScore / 2)
+        return score + ply;
+    if (score < -MateScore / 2)
+        return score - ply;
+    return score;
+}
+
+int denormalize_score(int score, int ply)
+{
+    if (score > MateScore / 2)
+        return score - ply;
+    if (score < -MateScore / 2)
+        return score + ply;
+    return score;
+}
+
+// from, to and promoted piece packed in 16 bits, 0 is no move
+inline uint16_t move_code(Move &move)
+{
+    return move.from | move.to << 6 | abs(move.promotion) << 12;
+}
+
+inline int TT_probe(TT_t TT, uint64_t mask, u_int64_t hash, int depth,
+                    int alpha, int beta, int ply, uint16_t &best_move)
+{
+    PROFILE_SCOPE(ProfileTT);
+    TT_t entry = &TT[hash & mask];
+    const uint64_t data = entry->data.load(memory_order_relaxed);
+    if (!data || (entry->key_xor_data.load(memory_order_relaxed) ^ data) != hash)
+        return TT_miss; // empty, another position or torn
+    const TTData d = TT_unpack(data);
+    best_move = d.best_move;
+    if (d.depth >= depth)
+    {
+        int score = denormalize_score(d.score, ply);
+        if (d.eval_type == Exact)
+            return score;
+        if (d.eval_type == LowerBound && score >= beta)
+            return beta;
+        if (d.eval_type == UpperBound && score <= alpha)
+            return alpha;
+    }
+    return TT_miss;
+}
+
+inline void TT_store(TT_t TT, uint64_t mask, u_int64_t hash, int depth,
+                     int score, EvalType eval_type, int ply, uint16_t best_move,
+                     int generation)
+{
+    PROFILE_SCOPE(ProfileTT);
+    TT_t entry = &TT[hash & mask];
+    const uint64_t old_data = entry->data.load(memory_order_relaxed);
+    const TTData old = TT_unpack(old_data);
+    const bool same = old_data && (entry->key_xor_data.load(memory_order_relaxed) ^
+                                   old_data) == hash;
+    if (old.age == TT_age(generation) && old.depth > depth)
+        return; // don't overwrite deeper scores of this search
+    if (same && !best_move)
+        best_move = old.best_move; // keep the old move for the same position
+    const uint64_t data =
+        TT_pack({best_move, normalize_score(score, ply), depth, eval_type,
+                 TT_age(generation)});
+    entry->key_xor_data.store(hash ^ data, memory_order_relaxed);
+    entry->data.store(data, memory_order_relaxed);
+}
+
+// helpers share the main search's TT instead of allocating their own, and
+// take its size
+Search::Search(TT_t shared_TT, int _hash_mb)
+{
+    stack.resize(MAX_PLY);
+    for (auto &ss : stack)
+    {
+        ss.moves.reserve(64);
+        ss.scores.reserve(64);
+    }
+    mobility_moves.reserve(64);
+    if (shared_TT)
+        TT = shared_TT;
+    else
+        init_TT(TT, TT_entries_for(_hash_mb));
+    TT_storage = shared_TT ? TTBorrowed : TTAllocated;
+    TT_mask = TT_entries(TT) - 1;
+    hash_mb = max(1, int(TT_entries(TT) * sizeof(TTEntry) >> 20));
+    init_reductions();
+    new_game();
+}
+
+Search::~Search() { free_TT(TT, TT_storage); }
+
+// a shared memory segment name or a file, "" to go back to a table of our own
+bool Search::set_mapped_hash(const string &name, bool file, string &error)
+{
+    TT_t table;
+    if (name.empty())
+        init_TT(table, TT_entries_for(hash_mb));
+    else if (!(table = map_TT(name, file, TT_entries_for(hash_mb), error)))
+        return false;
+    free_TT(TT, TT_storage);
+    TT = table;
+    TT_mask = TT_entries(TT) - 1;
+    TT_storage = name.empty() ? TTAllocated : TTMapped;
+    return true;
+}
+
+// a new, empty table of our own, throws bad_alloc. A mapped table keeps its
+// size, mb is the size of the segments mapped later
+void Search::set_hash_size(int mb)
+{
+    mb = max(1, min(mb, TT_max_mb));
+    if (TT_storage == TTAllocated)
+    {
+        TT_t table;
+        init_TT(table, TT_entries_for(mb));
+        free_TT(TT, TT_storage);
+        TT = table;
+        TT_mask = TT_entries(TT) - 1;
+    }
+    hash_mb = mb;
+}
+
+// forget everything learned from previous searches
+void Search::new_game()
+{
+    // a shared TT is cleared by its owner, the other searches use it too
+    if (TT_storage == TTAllocated)
+        clear_TT(TT);
+    for (auto &ss : stack)
+        ss.killers[0] = ss.killers[1] = 0;
+    memset(history, 0, sizeof(history));
+    memset(countermoves, 0, sizeof(countermoves));
+}
+
+// late move reductions grow with both depth and move number
+void Search::init_reductions()
+{
+    const double divisor = max(lmr_divisor, 1) / 100.0;
+    for (int depth = 0; depth < 64; depth++)
+        for (int moves = 0; moves < 64; moves++)
+        {
+            if (depth == 0 || moves == 0)
+                reductions[depth][moves] = 0;
+            else
+                reductions[depth][moves] =
+                    lmr_base / 100.0 + log(depth) * log(moves) / divisor;
+        }
+}
+
+void Search::set_clock(int _wtime, int _btime, int _winc, int _binc)
+{
+    wtime = _wtime;
+    btime = _btime;
+    winc = _winc;
+    binc = _binc;
+}
+
+// time to spend on this move in ms, from the search type and the clock
+int Search::time_budget()
+{
+    int budget = INT_MAX;
+    if (search_type == Time_per_move)
+        budget = mtime;
+    else if (search_type == Time_per_game)
+    {
+        double percentage = 1; // 0.88;
+        budget = (board.turn == White) ? (wtime + winc) : (btime + binc);
+        budget *= min((percentage + board.moves / 116.4) / 50, percentage);
+    }
+
+    // conservative time management
+    if (budget != INT_MAX)
+        budget *= 0.9;
+    budget = min(budget, max_time);
+
+    // no need to seach deeper if there's only one legal move
+    if (root_moves == 1)
+        budget = min(budget, 500);
+    return budget;
+}
+
+// the opponent played the expected move, the ponder search goes on as a
+// normal search whose clock starts now
+void Search::ponderhit()
+{
+    // in this order, so a search that saw pondering sees the flag too
+    pondering = false;
+    ponder_hit = true;
+}
+
+// the caller sets searching before starting it, so a stop that arrives before
+// the search thread gets going isn't lost
+pair<Move, int> Search::search()
+{
+    generation++;
+    // killers are tied to plies of the last search, history is only aged
+    for (auto &ss : stack)
+        ss.killers[0] = ss.killers[1] = 0;
+    for (auto &side : history)
+        for (auto &from : side)
+            for (auto &h : from)
+                h /= 2;
+
+    // without a proven mate the normal search looks as deep as the mate
+    if (search_type == Mate)
+    {
+        if (mate_moves > 0 && generate_legal_moves(board).size())
+        {
+            auto result = mate_search();
+            if (result.second)
+            {
+                searching = false;
+                return result;
+            }
+        }
+        search_type = Fixed_depth;
+        max_depth = max(1, 2 * mate_moves - 1);
+    }
+
+    auto movelist = iterative_search();
+    // bestmove can't be sent while pondering, even if the search is done
+    while (pondering && searching)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    searching = false;
+    pondering = false;
+
+    pv.clear();
+    if (movelist.size() == 0)
+    { // checkmate or stalemate
+        *out << "bestmove 0000" << "\n";
+        return {Move(), 0};
+    }
+
+    auto bestmove = movelist.front().move;
+    auto bestscore = movelist.front().score;
+
+    // choose random move out of same-scoring moves
+    vector<RootMove> bestmoves;
+    for (auto &rootmove : movelist)
+        if (rootmove.score == bestscore)
+            bestmoves.emplace_back(rootmove);
+
+    auto *best = &movelist.front();
+    if (bestmoves.size() > 1)
+    {
+        random_device rd;
+        uniform_int_distribution<int> dist(0, bestmoves.size() - 1);
+        best = &bestmoves[dist(rd)];
+        bestmove = best->move;
+        bestscore = best->score;
     }
 
-    cout << "info bestmove: " << bestscore << " = " << to_san(board, bestmove)
+    pv = best->pv;
+    *out << "info bestmove: " << bestscore << " = " << to_san(board, bestmove)
          << " out of " << movelist.size() << " legal, " << bestmoves.size()
          << " best" << "\n";
-    cout << "bestmove " << bestmove.to_uci() << "\n";
+    *out << "bestmove " << bestmove.to_uci();
+    if (best->pv.size() > 1) // the reply we expect, to ponder on
+        *out << " ponder " << best->pv[1].to_uci();
+    *out << "\n";
     return {bestmove, bestscore};
 }
 
@@ -2432,219 +3515,527 @@ pair<Move, int> Search::search()
 // mate -1: K7/8/1k6/5r2/8/8/8/8 w - - 0 1
 int get_mate_score(int score)
 {
+    // mated at ply n scores -MateScore + n, so a mate in k moves is n = 2k - 1
     if (score > MateScore / 2)
-        return (MateScore - score) / 2 + 1;
+        return (MateScore - score + 1) / 2;
     else if (score < -MateScore / 2)
-        return (-score - MateScore) / 2 - 1;
+        return -(MateScore + score) / 2;
     return 0;
 }
 
-void print_score(int score)
+void print_score(ostream &out, int score)
 {
     int mate = get_mate_score(score);
     if (mate == 0)
-        cout << " score cp " << score;
+        out << " score cp " << score;
     else
-        cout << " score mate " << mate;
+        out << " score mate " << mate;
 }
 
-void print_info(string infostring, int depth, int score, int nodes_searched,
-                int time_taken, string move)
+string pv_string(vector<Move> &pv)
 {
-    cout << infostring << " depth " << depth;
-    print_score(score);
-    cout << " nodes " << nodes_searched << " time " << time_taken << " pv "
-         << move << "\n";
+    string line;
+    for (auto &move : pv)
+        line += (line == "" ? "" : " ") + move.to_uci();
+    return line;
 }
 
-// PENDING: verify thoroughly
-vector<pair<int, Move>> Search::iterative_search()
+// a relaxed load and store, cheaper than an atomic increment, is enough as
+// no other thread writes the counter
+inline void Search::count_node()
 {
-    vector<pair<int, Move>> bestmoves;
-    int time_taken = 0;
-    int max_search_time = (board.turn == White) ? (wtime + winc) : (btime + binc);
-    if (search_type == Fixed_depth)
-    {
-        max_search_time = INT_MAX;
-        cout << "info using maxdepth: " << max_depth << "\n";
-    }
-    else if (search_type == Time_per_move)
-    {
-        max_search_time = mtime;
-        cout << "info using movetime: " << max_search_time << "\n";
-    }
-    else if (search_type == Time_per_game)
-    {
-        double percentage = 1; // 0.88;
-        max_search_time *= min((percentage + board.moves / 116.4) / 50, percentage);
-        cout << "info using time: " << max_search_time << "\n";
-    }
-    else
-    {
-        max_search_time = INT_MAX;
-        cout << "info using infinite: " << max_search_time << "\n";
-    }
+    nodes_searched.store(nodes_searched.load(memory_order_relaxed) + 1,
+                         memory_order_relaxed);
+}
 
-    const auto start_time = chrono::high_resolution_clock::now();
+uint64_t Search::total_nodes()
+{
+    uint64_t nodes = nodes_searched.load(memory_order_relaxed);
+    for (auto *helper : helpers)
+        nodes += helper->nodes_searched.load(memory_order_relaxed);
+    return nodes;
+}
 
-    // convert moves to score-move pairs
-    auto legals = generate_legal_moves(board);
-    vector<pair<int, Move>> legalmoves;
-    legalmoves.reserve(legals.size());
-    for (auto &move : legals)
-        legalmoves.emplace_back(0, move);
+// permille of a TT sample written by the current search
+int hashfull(TT_t TT, int generation)
+{
+    const int sample = min<uint64_t>(TT_entries(TT), 1000);
+    int used = 0;
+    for (int i = 0; i < sample; i++)
+        used += TT_unpack(TT[i].data.load(memory_order_relaxed)).age ==
+                TT_age(generation);
+    return used * 1000 / sample;
+}
 
-    // conservative time management
-    max_search_time *= 0.9;
+void Search::print_info(string infostring, int depth, int score, string pv)
+{
+    const int time_taken = time_elapsed();
+    const uint64_t nodes = total_nodes();
+    *out << infostring << " depth " << depth << " seldepth " << seldepth;
+    print_score(*out, score);
+    *out << " nodes " << nodes << " nps "
+         << (time_taken ? nodes * 1000 / time_taken : nodes) << " hashfull "
+         << hashfull(TT, generation) << " tbhits 0 time " << time_taken
+         << " pv " << pv << "\n";
+}
 
-    // iterative deepening
-    int depth = 1;
-    for (; searching && time_taken * 2 < max_search_time && depth <= max_depth;
-         depth++)
+// per iteration: nodes, effective branching factor (nodes over the previous
+// iteration's), share of cutoffs by the first move, TT hits and qnodes
+void Search::print_stats(ostream &out)
+{
+    auto percent = [](uint64_t part, uint64_t whole)
+    { return whole ? 100.0 * part / whole : 0.0; };
+    out << fixed << setprecision(1);
+    uint64_t last_nodes = 0, last_iteration = 0;
+    for (auto &it : iteration_stats)
     {
-        bestmoves.clear();
+        const uint64_t iteration = it.nodes - last_nodes;
+        out << "info string depth " << it.depth << " nodes " << iteration
+            << " time " << it.time << " ebf "
+            << (last_iteration ? double(iteration) / last_iteration : 0.0)
+            << " firstcut " << percent(it.first_move_fail_highs, it.fail_highs)
+            << "% tthit " << percent(it.tt_hits, it.tt_probes) << "% qnodes "
+            << percent(it.qnodes, it.nodes) << "%\n";
+        last_nodes = it.nodes;
+        last_iteration = iteration;
+    }
+    out << defaultfloat << setprecision(6);
+}
 
-        auto &curr_best = legalmoves.front();
-        auto &curr_worst = legalmoves.back();
+int Search::time_elapsed()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::high_resolution_clock::now() - start_time)
+        .count();
+}
 
-        // if (search_type != Mate && search_type != Infinite) {
-        // no need to seach deeper if there's only one legal move
-        if (legalmoves.size() == 1)
-        {
-            // limit search time
-            max_search_time = min(max_search_time, 500);
-            cout << "info only one legal move" << "\n";
-            // bestmoves.emplace_back(curr_best);
-            // break;
+// called every few thousand nodes, stops the search once time is up
+void Search::check_time()
+{
+    if (ponder_hit.exchange(false))
+    {
+        clock_start = time_elapsed();
+        max_search_time = min<long long>(INT_MAX, (long long)clock_start + budget);
+    }
+    if (time_elapsed() >= max_search_time ||
+        (max_nodes && total_nodes() >= max_nodes))
+        searching = false;
+}
+
+// principal variation search over the root moves from first on (the ones
+// before are earlier MultiPV lines), fail-hard in (alpha, beta)
+// the best move gets an exact score and PV and moves to first, the others
+// -MateScore
+int Search::root_search(vector<RootMove> &rootmoves, size_t first, int depth,
+                        int alpha, int beta)
+{
+    for (size_t i = first; i < rootmoves.size(); i++)
+    {
+        auto &rootmove = rootmoves[i];
+        if (helper_id == 0 && time_elapsed() > 3000)
+            *out << "info depth " << depth << " currmove "
+                 << rootmove.move.to_uci() << " currmovenumber " << i + 1 << "\n";
+        make_move(rootmove.move);
+        int score;
+        if (i == first)
+            score = -alphabeta(depth, -beta, -alpha);
+        else
+        { // null window to prove the move is worse, re-search if it isn't
+            score = -alphabeta(depth, -alpha - 1, -alpha);
+            if (score > alpha && score < beta)
+                score = -alphabeta(depth, -beta, -alpha);
         }
+        unmake_move();
+        if (!searching)
+            return alpha; // result is incomplete, the caller discards it
 
-        // mate found so prune non-mating moves (PENDING: verify)
-        if (get_mate_score(curr_best.first) > 0)
+        if (debug_mode)
+            print_info("info string", depth, score, rootmove.move.to_uci());
+        if (score > alpha)
         {
-            for (auto &move : legalmoves)
-                if (get_mate_score(move.first) > 0)
-                    bestmoves.emplace_back(move);
-            cout << "info mate found" << "\n";
-            break;
+            alpha = min(score, beta);
+            rootmove.score = alpha;
+            rootmove.pv.assign(1, rootmove.move);
+            rootmove.pv.insert(rootmove.pv.end(), stack[1].pv + 1,
+                               stack[1].pv + stack[1].pv_length);
+            // new best move goes first, for the next move's null window
+            rotate(rootmoves.begin() + first, rootmoves.begin() + i,
+                   rootmoves.begin() + i + 1);
         }
+        else
+            rootmove.score = -MateScore;
+        if (alpha >= beta)
+            return beta; // fail-high beta-cutoff
+    }
+    return alpha;
+}
+
+vector<RootMove> Search::iterative_search()
+{
+    vector<RootMove> bestmoves;
+    int time_taken = 0;
 
-        // worst move is losing so prune losing moves
-        if (get_mate_score(curr_worst.first) < 0)
+    start_time = chrono::high_resolution_clock::now();
+    nodes_searched = 0;
+    stats = SearchStats();
+    iteration_stats.clear();
+    ply = 0;
+    stack[0].key = board.zobrist_hash();
+    stack[0].static_eval = is_in_check(board, board.turn)
+                               ? -MateScore
+                               : eval<false>() * board.turn;
+
+    vector<RootMove> rootmoves;
+    for (auto &move : generate_legal_moves(board))
+        rootmoves.push_back({-MateScore, move, {move}});
+    if (rootmoves.size() == 0)
+        return rootmoves;
+    root_moves = rootmoves.size();
+
+    // only the moves asked for, an empty list means all
+    if (search_moves.size())
+        rootmoves.erase(remove_if(rootmoves.begin(), rootmoves.end(),
+                                  [&](RootMove &rootmove)
+                                  {
+                                      for (auto &move : search_moves)
+                                          if (move.equals(rootmove.move))
+                                              return false;
+                                      return true;
+                                  }),
+                        rootmoves.end());
+
+    // while pondering it's the opponent's time, ponderhit sets the deadline.
+    // The budget is taken now, before the search moves on the board
+    clock_start = 0;
+    budget = time_budget();
+    ponder_hit = false;
+    max_search_time = pondering ? INT_MAX : budget;
+    if (pondering)
+        *out << "info using ponder" << "\n";
+    else if (search_type == Fixed_depth)
+        *out << "info using maxdepth: " << max_depth << "\n";
+    else if (search_type == Time_per_move)
+        *out << "info using movetime: " << max_search_time << "\n";
+    else if (search_type == Time_per_game)
+        *out << "info using time: " << max_search_time << "\n";
+    else
+        *out << "info using infinite: " << max_search_time << "\n";
+    if (root_moves == 1)
+        *out << "info only one legal move" << "\n";
+
+    // iterative deepening, half of the helpers skip depth 1 so the threads
+    // spread over different depths
+    for (int depth = 1 + helper_id % 2;
+         searching && (time_taken - clock_start) * 2 < max_search_time - clock_start &&
+         depth <= max_depth;
+         depth++)
+    {
+        seldepth = 0;
+        // one line at a time, each searches the moves left by the ones before
+        const size_t lines = min<size_t>(multi_pv, rootmoves.size());
+        for (size_t line = 0; line < lines && searching; line++)
         {
-            // there is atleast one non-losing move
-            if (get_mate_score(curr_best.first) == 0)
-            {
-                // prune losing moves
-                for (auto &move : legalmoves)
-                    if (get_mate_score(move.first) == 0)
-                        bestmoves.emplace_back(move);
-                if (bestmoves.size() != 0)
-                    legalmoves = bestmoves;
-                // break;
-                cout << "info pruned losing moves" << "\n";
-            }
-            else
+            // aspiration window around the line's last score, widened on failure
+            const int last_score =
+                bestmoves.size() > line ? bestmoves[line].score : 0;
+            int delta = aspiration_window;
+            int alpha = -MateScore, beta = MateScore;
+            if (depth >= 4 && abs(last_score) < MateScore / 2)
             {
-                // best and worst move is losing, so no point in searching deeper
-                bestmoves = legalmoves;
-                // if (search_type != Mate && search_type != Infinite)
-                cout << "info all moves are losing" << "\n";
-                break;
+                alpha = max(last_score - delta, -MateScore);
+                beta = min(last_score + delta, MateScore);
             }
-        }
 
-        for (auto &score_move : legalmoves)
-        {
-            nodes_searched = 0;
-            ply = -1; // somehow this fixes the reported mate score
-            ply++;
-            board.make_move(score_move.second);
-            int score = 0;
-            // score = -negamax(depth);
-            score = -alphabeta(depth, -MateScore, +MateScore);
-            board.unmake_move(score_move.second);
-            ply--;
-            time_taken = chrono::duration_cast<chrono::milliseconds>(
-                             chrono::high_resolution_clock::now() - start_time)
-                             .count();
-            // break if time is up, but ensure we have atleast one move
-            if (!searching || time_taken >= max_search_time)
+            while (true)
             {
-                if (bestmoves.size() == 0)
-                {
-                    bestmoves = legalmoves;
-                }
-                searching = false;
-                cout << "info time is up" << "\n";
-                break;
+                const int score = root_search(rootmoves, line, depth, alpha, beta);
+                if (!searching)
+                    break;
+                if (score <= alpha && alpha > -MateScore)
+                    alpha = max(alpha - delta, -MateScore); // fail low
+                else if (score >= beta && beta < MateScore)
+                    beta = min(beta + delta, MateScore); // fail high
+                else
+                    break;
+                delta *= 2;
             }
-            score_move.first = score;
-            if (debug_mode)
-                print_info("info string", depth, score, nodes_searched, time_taken,
-                           score_move.second.to_uci());
-            bestmoves.emplace_back(score, score_move.second);
         }
 
+        time_taken = time_elapsed();
+        // break if time is up, keeping the last completed iteration
         if (!searching)
+        {
+            if (bestmoves.size() == 0)
+                bestmoves = rootmoves;
+            *out << "info time is up" << "\n";
             break;
-        // move-ordering
-        stable_sort(legalmoves.begin(), legalmoves.end(),
-                    [](auto &a, auto &b)
-                    { return a.first > b.first; });
+        }
+        bestmoves = rootmoves;
+
+        auto &best = rootmoves.front();
+        stats.depth = depth;
+        stats.time = time_taken;
+        stats.nodes = nodes_searched;
+        stats.bestmove = best.move;
+        iteration_stats.push_back(stats);
 
-        time_taken = chrono::duration_cast<chrono::milliseconds>(
-                         chrono::high_resolution_clock::now() - start_time)
-                         .count();
-        print_info("info", depth, legalmoves.front().first, nodes_searched,
-                   time_taken, legalmoves.front().second.to_uci());
+        if (lines == 1)
+            print_info("info", depth, best.score, pv_string(best.pv));
+        else
+            for (size_t line = 0; line < lines; line++)
+                print_info("info multipv " + to_string(line + 1), depth,
+                           rootmoves[line].score, pv_string(rootmoves[line].pv));
 
-        // PENDING: fix this
-        if (search_type == Mate)
-            debug = to_string(get_mate_score(legalmoves.front().first));
+        // no point in searching deeper once the outcome is known, unless
+        // the other lines are wanted too
+        if (lines > 1)
+            continue;
+        if (get_mate_score(best.score) > 0)
+        {
+            *out << "info mate found" << "\n";
+            break;
+        }
+        if (get_mate_score(best.score) < 0)
+        {
+            *out << "info all moves are losing" << "\n";
+            break;
+        }
     }
 
-    cout << "info total time: " << time_taken << "\n";
+    *out << "info total time: " << time_taken << "\n";
+    if (bestmoves.size() == 0) // stopped before the first iteration was done
+        bestmoves = rootmoves;
 
     // PENDING: choose random move out of same-scoring moves
 
     // move-ordering
     stable_sort(bestmoves.begin(), bestmoves.end(),
                 [](auto &a, auto &b)
-                { return a.first > b.first; });
+                { return a.score > b.score; });
 
     return bestmoves;
 }
 
-template int Search::eval<true>();  // prints eval
-template int Search::eval<false>(); // doesn't print eval
+// proof-number mate search, for go mate N
+// the attacker (side to move at the root) only tries checks and the defender
+// all evasions, so the tree stays narrow. pn is how many leaves still have to
+// be proven a mate to prove the node, dn how many to disprove it. the most
+// proving leaf is expanded until the root is proven or disproven
+const uint32_t PNInfinity = 1u << 30;
 
-template <bool debug>
-inline int Search::eval()
+// the legal move with the given move_code, generated again as it carries the
+// flags make_move needs
+Move find_move(Board &board, uint16_t code)
 {
-    int material_score = 0;
-    int pst_score = 0;
-    int mobility_score = 0;
-    int endgame_score = 0;
-    int material_count[7] = {0};
+    for (auto &move : generate_legal_moves(board))
+        if (move_code(move) == code)
+            return move;
+    return Move();
+}
 
-    // calculate material and piece-square table score
-    for (int i = 0; i < 64; i++)
+bool gives_check(Board &board, Move &move)
+{
+    board.make_move(move);
+    bool check = board.turn == White ? is_check<White>(board, move)
+                                     : is_check<Black>(board, move);
+    board.unmake_move(move);
+    return check;
+}
+
+// children of node n, at ply, are appended to the tree; terminal nodes get
+// their final numbers instead
+void Search::pn_expand(vector<PNNode> &tree, int n, int ply)
+{
+    auto &moves = stack[0].moves;
+    const bool attacker = ply % 2 == 0;
+    if (board.turn == White)
+        (tree[n].in_check ? generate_legal_moves2<White, Evasions>(board, moves)
+                          : generate_legal_moves2<White, NonEvasions>(board, moves));
+    else
+        (tree[n].in_check ? generate_legal_moves2<Black, Evasions>(board, moves)
+                          : generate_legal_moves2<Black, NonEvasions>(board, moves));
+    if (attacker)
+        moves.erase(remove_if(moves.begin(), moves.end(),
+                              [&](Move &move)
+                              { return !gives_check(board, move); }),
+                    moves.end());
+
+    tree[n].expanded = true;
+    if (!attacker && moves.empty())
+    { // checkmate
+        tree[n].pn = 0;
+        tree[n].dn = PNInfinity;
+        return;
+    }
+    if (moves.empty() || ply >= 2 * mate_moves - 1)
+    { // no checks left, or out of moves to mate with
+        tree[n].pn = PNInfinity;
+        tree[n].dn = 0;
+        return;
+    }
+
+    tree[n].first_child = tree.size();
+    tree[n].children = moves.size();
+    for (auto &move : moves)
     {
-        const Piece piece = board.board[i];
-        material_count[abs(piece)]++;
-        material_score += piece_val[piece + 6];
-        if (piece)
-            pst_score +=
-                pst[abs(piece) - 1][piece > 0 ? i : 63 - i] * (piece > 0 ? 1 : -1);
+        PNNode child;
+        child.move = move_code(move);
+        child.parent = n;
+        child.in_check = attacker || gives_check(board, move);
+        tree.push_back(child);
     }
+}
 
-    // calculate phase
-    // https://www.chessprogramming.org/Tapered_Eval
-    const int PawnPhase = 0;
-    const int KnightPhase = 1;
-    const int BishopPhase = 1;
-    const int RookPhase = 2;
-    const int QueenPhase = 4;
+// pn and dn of node n from its children, the attacker needs one child proven,
+// the defender all of them
+void pn_update(vector<PNNode> &tree, int n, bool attacker)
+{
+    auto &node = tree[n];
+    uint64_t pn = attacker ? PNInfinity : 0, dn = attacker ? 0 : PNInfinity;
+    for (int c = node.first_child; c < node.first_child + node.children; c++)
+        if (attacker)
+        {
+            pn = min<uint64_t>(pn, tree[c].pn);
+            dn += tree[c].dn;
+        }
+        else
+        {
+            pn += tree[c].pn;
+            dn = min<uint64_t>(dn, tree[c].dn);
+        }
+    node.pn = min<uint64_t>(pn, PNInfinity);
+    node.dn = min<uint64_t>(dn, PNInfinity);
+}
+
+// plies to mate along the proof, the attacker takes the quickest proven
+// child and the defender the slowest
+int pn_mate_length(vector<PNNode> &tree, int n, bool attacker)
+{
+    auto &node = tree[n];
+    if (node.children == 0)
+        return 0;
+    int length = attacker ? INT_MAX : 0;
+    for (int c = node.first_child; c < node.first_child + node.children; c++)
+    {
+        if (tree[c].pn != 0)
+            continue;
+        const int l = 1 + pn_mate_length(tree, c, !attacker);
+        length = attacker ? min(length, l) : max(length, l);
+    }
+    return length;
+}
+
+pair<Move, int> Search::mate_search()
+{
+    start_time = chrono::high_resolution_clock::now();
+    max_search_time = time_budget();
+    nodes_searched = 0;
+    *out << "info using mate: " << mate_moves << "\n";
+
+    vector<PNNode> tree(1);
+    tree[0].in_check = is_in_check(board, board.turn);
+    vector<Move> path; // moves from the root to the node being expanded
+
+    while (tree[0].pn && tree[0].dn && searching &&
+           int(tree.size()) < mate_node_limit)
+    {
+        // the most proving node: the attacker follows the smallest pn, the
+        // defender the smallest dn
+        int n = 0;
+        while (tree[n].expanded)
+        {
+            const bool attacker = path.size() % 2 == 0;
+            int best = tree[n].first_child;
+            for (int c = best; c < tree[n].first_child + tree[n].children; c++)
+                if (attacker ? tree[c].pn < tree[best].pn : tree[c].dn < tree[best].dn)
+                    best = c;
+            path.push_back(find_move(board, tree[best].move));
+            board.make_move(path.back());
+            n = best;
+        }
+
+        pn_expand(tree, n, path.size());
+        count_node();
+
+        // back up the new numbers to the root
+        while (path.size())
+        {
+            board.unmake_move(path.back());
+            path.pop_back();
+            n = tree[n].parent;
+            pn_update(tree, n, path.size() % 2 == 0);
+        }
+        if ((nodes_searched & 1023) == 0)
+            check_time();
+    }
+
+    if (tree[0].pn != 0)
+    {
+        *out << "info string no mate in " << mate_moves << " found, "
+             << (tree[0].dn == 0 ? "disproven" : "search stopped") << "\n";
+        return {Move(), 0};
+    }
+
+    // the proof's main line
+    vector<Move> pv;
+    int n = 0;
+    while (tree[n].children)
+    {
+        const bool attacker = pv.size() % 2 == 0;
+        int best = -1, best_length = 0;
+        for (int c = tree[n].first_child; c < tree[n].first_child + tree[n].children; c++)
+        {
+            if (tree[c].pn != 0)
+                continue;
+            const int l = pn_mate_length(tree, c, !attacker);
+            if (best == -1 || (attacker ? l < best_length : l > best_length))
+                best = c, best_length = l;
+        }
+        pv.push_back(find_move(board, tree[best].move));
+        board.make_move(pv.back());
+        n = best;
+    }
+    for (int i = pv.size() - 1; i >= 0; i--)
+        board.unmake_move(pv[i]);
+
+    const int score = MateScore - int(pv.size());
+    seldepth = pv.size();
+    print_info("info", pv.size(), score, pv_string(pv));
+    *out << "bestmove " << pv[0].to_uci() << "\n";
+    return {pv[0], score};
+}
+
+template int Search::eval<true>();  // prints eval
+template int Search::eval<false>(); // doesn't print eval
+
+template <bool debug>
+inline int Search::eval()
+{
+    PROFILE_SCOPE(ProfileEval);
+    int material_score = 0;
+    int pst_score = 0;
+    int mobility_score = 0;
+    int endgame_score = 0;
+    int material_count[7] = {0};
+
+    // calculate material and piece-square table score
+    for (int i = 0; i < 64; i++)
+    {
+        const Piece piece = board.board[i];
+        material_count[abs(piece)]++;
+        material_score += piece_val[piece + 6];
+        if (piece)
+            pst_score +=
+                pst[abs(piece) - 1][piece > 0 ? i : 63 - i] * (piece > 0 ? 1 : -1);
+    }
+
+    // calculate phase
+    // https://www.chessprogramming.org/Tapered_Eval
+    const int PawnPhase = 0;
+    const int KnightPhase = 1;
+    const int BishopPhase = 1;
+    const int RookPhase = 2;
+    const int QueenPhase = 4;
     const int TotalPhase = PawnPhase * 16 + KnightPhase * 4 + BishopPhase * 4 +
                            RookPhase * 4 + QueenPhase * 2;
 
@@ -2668,10 +4059,17 @@ inline int Search::eval()
 
     // Comment out the part from start to end if it causes irregular behaviour(especially in endgame)
     //start
-        int rel_mobility = generate_legal_moves(board).size();
+        generate_legal_moves(board, mobility_moves);
+        int rel_mobility = mobility_moves.size();
+        // the enpassant square belongs to the side to move, hide it while
+        // generating for the opponent or it'd "restore" a pawn that isn't there
+        const int enpassant_sq_idx = board.enpassant_sq_idx;
+        board.enpassant_sq_idx = -1;
         board.change_turn();
-        int opp_mobility = generate_legal_moves(board).size();
+        generate_legal_moves(board, mobility_moves);
+        int opp_mobility = mobility_moves.size();
         board.change_turn();
+        board.enpassant_sq_idx = enpassant_sq_idx;
         mobility_score = (rel_mobility - opp_mobility) * board.turn;
     //end
     const int score = material_score + pst_score + 2 * mobility_score;
@@ -2689,7 +4087,7 @@ inline int Search::eval()
         cout << "adjusted endgame score: " << endgame_score * phase / 256 << "\n";
 
         cout << "is in check: " << is_in_check(board, board.turn) << "\n";
-        cout << "is repetition: " << is_repetition() << "\n";
+        cout << "is repetition: " << is_repetition(board.zobrist_hash()) << "\n";
     }
 
     return eval;
@@ -2703,13 +4101,9 @@ int Search::negamax(int depth)
     auto legals = generate_legal_moves(board);
     for (auto &move : legals)
     {
-        ply++;
-        repetitions.push_back(board.zobrist_hash());
-        board.make_move(move);
+        make_move(move);
         int score = -negamax(depth - 1);
-        board.unmake_move(move);
-        repetitions.pop_back();
-        ply--;
+        unmake_move();
         if (score > bestscore)
         {
             bestscore = score;
@@ -2721,70 +4115,386 @@ int Search::negamax(int depth)
     return bestscore;
 }
 
-int Search::alphabeta(int depth, int alpha, int beta)
+// move ordering
+const int TTMoveScore = 1 << 30;
+const int GoodCaptureScore = 1 << 20;
+const int KillerScore = 1 << 19;
+const int CounterMoveScore = (1 << 19) - 2;
+const int MaxHistory = 1 << 14; // history scores stay within +-MaxHistory
+const int BadCaptureScore = -(1 << 20);
+
+inline bool is_capture(Board &board, Move &move)
+{
+    return board[move.to] != Empty || move.enpassant;
+}
+
+// most valuable victim, least valuable attacker
+inline int mvv_lva(Board &board, Move &move)
+{
+    const int victim = move.enpassant ? wP : abs(board[move.to]);
+    const int attacker = abs(board[move.from]);
+    return abs(piece_val[victim + 6]) * 10 - abs(piece_val[attacker + 6]) / 100;
+}
+
+// the TT move first, then winning and equal captures (by SEE), then killers,
+// the countermove and the other quiet moves by history, then losing
+// captures; promotions count as captures
+void Search::score_moves(vector<Move> &moves, vector<int> &scores,
+                         uint16_t TT_move)
+{
+    const int side = board.turn == White ? 0 : 1;
+    const uint16_t prev = ply ? stack[ply - 1].move : 0;
+    const uint16_t counter = prev ? countermoves[prev & 63][prev >> 6 & 63] : 0;
+    const auto &killers = stack[ply].killers;
+
+    scores.resize(moves.size());
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+        auto &move = moves[i];
+        const uint16_t code = move_code(move);
+        if (TT_move && code == TT_move)
+            scores[i] = TTMoveScore;
+        else if (is_capture(board, move) || move.promotion != Empty)
+            scores[i] = (see(board, move, 0) ? GoodCaptureScore : BadCaptureScore) +
+                        mvv_lva(board, move) + abs(piece_val[move.promotion + 6]);
+        else if (code == killers[0])
+            scores[i] = KillerScore;
+        else if (code == killers[1])
+            scores[i] = KillerScore - 1;
+        else if (code == counter)
+            scores[i] = CounterMoveScore;
+        else
+            scores[i] = history[side][move.from][move.to];
+    }
+}
+
+// a quiet move caused a beta cutoff: remember it as killer and countermove,
+// reward its history and penalize the quiet moves searched before it
+void Search::update_quiet_stats(uint16_t move, uint16_t *quiets, int quiets_n,
+                                int depth)
+{
+    auto &killers = stack[ply].killers;
+    if (killers[0] != move)
+    {
+        killers[1] = killers[0];
+        killers[0] = move;
+    }
+
+    const uint16_t prev = ply ? stack[ply - 1].move : 0;
+    if (prev)
+        countermoves[prev & 63][prev >> 6 & 63] = move;
+
+    // gravity: the closer to MaxHistory the smaller the change
+    const int side = board.turn == White ? 0 : 1;
+    const int bonus = min(depth * depth, 1200);
+    auto update = [&](uint16_t m, int bonus)
+    {
+        int &h = history[side][m & 63][m >> 6 & 63];
+        h += bonus - h * abs(bonus) / MaxHistory;
+    };
+    update(move, bonus);
+    for (int i = 0; i < quiets_n; i++)
+        if (quiets[i] != move)
+            update(quiets[i], -bonus);
+}
+
+// bring the best scored of the remaining moves to index i, a selection sort
+// that only does the work for moves actually searched before a cutoff
+inline void pick_move(vector<Move> &moves, vector<int> &scores, size_t i)
+{
+    size_t best = i;
+    for (size_t j = i + 1; j < moves.size(); j++)
+        if (scores[j] > scores[best])
+            best = j;
+    if (best != i)
+    {
+        swap(moves[i], moves[best]);
+        swap(scores[i], scores[best]);
+    }
+}
+
+// side has something other than king and pawns, null move is unsafe
+// otherwise, since those endgames are full of zugzwang
+inline bool has_non_pawn_material(Board &board, Player side)
+{
+    for (int i = 0; i < 64; i++)
+    {
+        const Piece p = Piece(board[i] * side);
+        if (p == wN || p == wB || p == wR || p == wQ)
+            return true;
+    }
+    return false;
+}
+
+// the trace wraps the node searches, so they don't pay for it when it's off.
+// Nodes cut short by the time check have no real score and aren't recorded
+int Search::alphabeta(int depth, int alpha, int beta, bool null_ok)
+{
+    if (!tracer)
+        return alphabeta_node(depth, alpha, beta, null_ok);
+    const uint64_t nodes = nodes_searched;
+    const int score = alphabeta_node(depth, alpha, beta, null_ok);
+    // at the horizon the node was handed to quiesce, which recorded it
+    if (searching && stack[ply].node_type != TraceQuiesce)
+        trace(depth, alpha, beta, score, nodes_searched - nodes);
+    return score;
+}
+
+int Search::quiesce(int depth, int alpha, int beta)
+{
+    if (!tracer)
+        return quiesce_node(depth, alpha, beta);
+    const uint64_t nodes = nodes_searched;
+    const int score = quiesce_node(depth, alpha, beta);
+    if (searching)
+        trace(-depth, alpha, beta, score, nodes_searched - nodes);
+    return score;
+}
+
+void Search::trace(int depth, int alpha, int beta, int score, uint64_t nodes)
 {
-    if (ply && is_repetition())
+    auto &ss = stack[ply];
+    TraceRecord record = {};
+    record.alpha = alpha;
+    record.beta = beta;
+    record.score = score;
+    record.nodes = min<uint64_t>(nodes, UINT32_MAX);
+    record.move = ply ? stack[ply - 1].move : 0;
+    record.best_move = ss.best_move;
+    record.ply = ply;
+    record.depth = max(-128, min(depth, 127));
+    record.type = ss.node_type;
+    record.cutoff_index = ss.cutoff_index;
+    record.researches = ss.researches;
+    tracer->record(record);
+}
+
+int Search::alphabeta_node(int depth, int alpha, int beta, bool null_ok)
+{
+    auto &ss = stack[ply];
+    ss.pv_length = ply;
+    ss.node_type = TraceEarly;
+    ss.cutoff_index = ss.researches = 0;
+    ss.best_move = 0;
+    seldepth = max(seldepth, ply);
+    const bool pv_node = beta - alpha > 1;
+    const uint64_t hash = ss.key = board.zobrist_hash();
+
+    if (ply && is_repetition(hash))
         return 0;
 
-    // PENDING: probe TT
-    // const int TT_score = TT_probe(TT, board.zobrist_hash(), depth, alpha,
-    // beta); if (TT_score != TT_miss) return TT_score;
+    // a move reaching an earlier position is available, so we can draw
+    if (ply && upcoming_repetition && alpha < 0 && has_upcoming_repetition(hash))
+    {
+        alpha = 0;
+        if (alpha >= beta)
+            return beta;
+    }
 
-    if (depth == 0)
+    if (depth <= 0)
         return quiesce(0, alpha, beta);
 
+    if (ply >= MAX_PLY - 1)
+        return eval<false>() * board.turn;
+
+    if ((nodes_searched & 2047) == 0)
+        check_time();
+    if (!searching)
+        return 0;
+
+    // PV nodes only take the move, their scores must come from a real search
+    uint16_t TT_move = 0;
+    const int TT_score =
+        TT_probe(TT, TT_mask, hash, depth, alpha, beta, ply, TT_move);
+    stats.tt_probes++;
+    stats.tt_hits += TT_move || TT_score != TT_miss;
+    if (!pv_node && TT_score != TT_miss)
+        return TT_score;
+
     bool in_check = is_in_check(board, board.turn);
 
-    nodes_searched++;
+    count_node();
     // check extension
     if (in_check)
         depth++;
 
-    int score = 0;
+    const int static_eval = ss.static_eval =
+        in_check ? -MateScore : eval<false>() * board.turn;
+    // is the position better than the last time we were to move?
+    const bool improving =
+        !in_check && ply >= 2 && static_eval > stack[ply - 2].static_eval;
 
-    auto legals = generate_legal_moves(board);
+    if (!pv_node && !in_check)
+    {
+        // reverse futility pruning: too far above beta to fall back below it
+        if (depth <= rfp_max_depth && beta < MateScore / 2 &&
+            static_eval - rfp_margin * (depth - improving) >= beta)
+            return beta;
+
+        // null move pruning: passing still fails high, so a real move will too
+        if (null_ok && depth >= null_move_min_depth && static_eval >= beta &&
+            has_non_pawn_material(board, board.turn))
+        {
+            const int R = null_move_reduction + depth / 6;
+            make_null_move();
+            const int score = -alphabeta(depth - 1 - R, -beta, -beta + 1, false);
+            unmake_null_move();
+            if (!searching)
+                return 0;
+            if (score >= beta)
+                return beta;
+        }
+    }
 
-    // EvalType eval_type = UpperBound;
+    // futility pruning: quiet moves can't bring a hopeless eval up to alpha
+    const bool futile = !pv_node && !in_check && depth <= futility_max_depth &&
+                        alpha > -MateScore / 2 &&
+                        static_eval + futility_margin * depth <= alpha;
 
-    for (auto &move : legals)
+    int score = 0;
+    int moves_searched = 0;
+    uint16_t best_move = 0;
+    uint16_t quiets[64]; // quiet moves searched, penalized on a cutoff
+    int quiets_n = 0;
+
+    auto &legals = ss.moves;
+    auto &scores = ss.scores;
+    generate_legal_moves(board, legals);
+    score_moves(legals, scores, TT_move);
+
+    for (size_t i = 0; i < legals.size(); i++)
     {
-        ply++;
-        repetitions.push_back(board.zobrist_hash());
-        board.make_move(move);
-        // PENDING: late move reduction
-        // full window search if not LMR
-        score = -alphabeta(depth - 1, -beta, -alpha);
-        board.unmake_move(move);
-        repetitions.pop_back();
-        ply--;
+        pick_move(legals, scores, i);
+        auto &move = legals[i];
+        const bool quiet = !is_capture(board, move) && move.promotion == Empty;
+        make_move(move);
+        const bool gives_check = is_in_check(board, board.turn);
+
+        if (futile && quiet && !gives_check && moves_searched > 0)
+        {
+            unmake_move();
+            continue;
+        }
+
+        if (moves_searched == 0)
+        { // full window search for the first (expected best) move
+            score = -alphabeta(depth - 1, -beta, -alpha);
+        }
+        else
+        {
+            // late move reduction
+            int R = 0;
+            if (depth >= lmr_min_depth && moves_searched >= lmr_min_moves &&
+                quiet && !in_check && !gives_check)
+            {
+                R = reductions[min(depth, 63)][min(moves_searched, 63)];
+                R = max(0, min(R - pv_node, depth - 2));
+            }
+            // null window to prove the move is worse than the best so far,
+            // re-searched unreduced and then with the full window if it isn't
+            score = -alphabeta(depth - 1 - R, -alpha - 1, -alpha);
+            if (score > alpha && R > 0)
+            {
+                ss.researches++;
+                score = -alphabeta(depth - 1, -alpha - 1, -alpha);
+            }
+            if (score > alpha && score < beta)
+            {
+                ss.researches++;
+                score = -alphabeta(depth - 1, -beta, -alpha);
+            }
+        }
+        unmake_move();
+        if (!searching)
+            return 0;
+        moves_searched++;
         if (score > alpha)
         {
-            // PENDING: PV update
-            // eval_type = Exact;
             alpha = score;
+            best_move = move_code(move);
             if (alpha >= beta)
             { // fail-high beta-cutoff
-                // // PENDING: store TT
-                // TT_store(TT, board.zobrist_hash(), depth, beta, LowerBound);
+                stats.fail_highs++;
+                stats.first_move_fail_highs += moves_searched == 1;
+                ss.node_type = TraceCut;
+                ss.cutoff_index = min(moves_searched, 255);
+                ss.best_move = best_move;
+                if (quiet)
+                    update_quiet_stats(best_move, quiets, quiets_n, depth);
+                TT_store(TT, TT_mask, hash, depth, beta, LowerBound, ply,
+                         best_move, generation);
                 return beta;
             }
+            update_pv(move);
         }
+        if (quiet && quiets_n < 64)
+            quiets[quiets_n++] = move_code(move);
     }
 
     // checkmate or stalemate
     if (legals.size() == 0)
         return in_check ? -MateScore + ply : 0;
 
-    // // PENDING: store TT
-    // TT_store(TT, board.zobrist_hash(), depth, alpha, eval_type);
+    ss.node_type = best_move ? TracePV : TraceAll;
+    ss.best_move = best_move;
+    TT_store(TT, TT_mask, hash, depth, alpha, best_move ? Exact : UpperBound,
+             ply, best_move, generation);
     return alpha; // fail-low alpha-cutoff
 }
 
-int Search::quiesce(int depth, int alpha, int beta)
+// move leads the PV of this ply, followed by the PV of the next
+void Search::update_pv(Move &move)
+{
+    auto &ss = stack[ply], &next = stack[ply + 1];
+    ss.pv[ply] = move;
+    for (int i = ply + 1; i < next.pv_length; i++)
+        ss.pv[i] = next.pv[i];
+    ss.pv_length = max(next.pv_length, ply + 1);
+}
+
+// the move's undo state is kept on the stack, so the caller's copy stays as
+// generated
+void Search::make_move(Move &move)
 {
-    int stand_pat = eval<false>() * board.turn;
+    auto &ss = stack[ply];
+    ss.undo = move;
+    ss.move = move_code(move);
+    board.make_move(ss.undo);
+    ply++;
+}
+
+void Search::unmake_move()
+{
+    ply--;
+    board.unmake_move(stack[ply].undo);
+}
+
+void Search::make_null_move()
+{
+    auto &ss = stack[ply];
+    ss.move = 0;
+    board.make_null_move(ss.undo);
+    ply++;
+}
+
+void Search::unmake_null_move()
+{
+    ply--;
+    board.unmake_null_move(stack[ply].undo);
+}
+
+int Search::quiesce_node(int depth, int alpha, int beta)
+{
+    auto &ss = stack[ply];
+    ss.pv_length = ply;
+    ss.node_type = TraceQuiesce;
+    ss.cutoff_index = ss.researches = 0;
+    ss.best_move = 0;
+    seldepth = max(seldepth, ply);
 
-    if (depth > max_depth)
+    int stand_pat = ss.static_eval = eval<false>() * board.turn;
+
+    if (depth > max_depth || ply >= MAX_PLY - 1)
         return stand_pat; // max depth reached
 
     if (stand_pat >= beta)
@@ -2796,199 +4506,1465 @@ int Search::quiesce(int depth, int alpha, int beta)
     { // fail-low alpha-cutoff
         alpha = stand_pat;
     }
-    nodes_searched++;
-
-    auto legals = generate_legal_moves(board);
-
-    for (auto &move : legals)
+    count_node();
+    stats.qnodes++;
+
+    // keep only captures, most valuable victim first
+    auto &captures = ss.moves;
+    auto &scores = ss.scores;
+    generate_legal_moves(board, captures);
+    captures.erase(remove_if(captures.begin(), captures.end(),
+                             [&](Move &move)
+                             { return board[move.to] == Empty; }),
+                   captures.end());
+    scores.clear();
+    for (auto &move : captures)
+        scores.push_back(mvv_lva(board, move));
+
+    for (size_t i = 0; i < captures.size(); i++)
     {
-        if (board[move.to] == Empty)
-            continue; // ignore non-capturing moves
-        ply++;
-        repetitions.push_back(board.zobrist_hash());
-        board.make_move(move);
+        pick_move(captures, scores, i);
+        auto &move = captures[i];
+        if (!see(board, move, 0))
+            continue; // losing capture, can't raise alpha over stand pat
+        make_move(move);
         int score = -quiesce(depth + 1, -beta, -alpha);
-        board.unmake_move(move);
-        repetitions.pop_back();
-        ply--;
+        unmake_move();
         if (score > alpha)
         {
             alpha = score;
+            ss.best_move = move_code(move);
             if (alpha >= beta)
             { // fail-high beta-cutoff
+                ss.cutoff_index = min<size_t>(i + 1, 255);
                 return beta;
             }
+            update_pv(move);
         }
     }
 
     return alpha; // fail-low alpha-cutoff
 }
 
-bool Search::is_repetition()
+// key of the position plies ago, from the stack inside the search and from
+// the game history before the root
+uint64_t Search::key_back(int plies)
 {
-    const auto hash = board.zobrist_hash();
-    int n = repetitions.size();
-    for (int i = 0; i < n - 1; i++)
+    if (plies <= ply)
+        return stack[ply - plies].key;
+    return repetitions[repetitions.size() - (plies - ply)];
+}
+
+// only the same side to move can repeat, and nothing before the last capture,
+// pawn move or null move (all reset fifty) can come back
+bool Search::is_repetition(uint64_t hash)
+{
+    const int end = min<int>(board.fifty, ply + repetitions.size());
+    for (int i = 4; i <= end; i += 2)
+        if (key_back(i) == hash)
+            return true;
+    return false;
+}
+
+// is there a move from the current position to a position seen i plies ago?
+// then the keys differ by exactly one reversible piece move, which the
+// cuckoo tables find; only positions inside the search tree are considered
+bool Search::has_upcoming_repetition(uint64_t hash)
+{
+    const int end = min(board.fifty, ply - 1);
+    for (int i = 3; i <= end; i += 2)
     {
-        if (repetitions[i] == hash)
+        const uint64_t move_key = hash ^ stack[ply - i].key;
+        int j = Cuckoo::h1(move_key);
+        if (Cuckoo::keys[j] != move_key)
+            j = Cuckoo::h2(move_key);
+        if (Cuckoo::keys[j] != move_key)
+            continue;
+
+        // the squares in between must be empty for the move to be legal
+        const int from = Cuckoo::moves[j] & 63, to = Cuckoo::moves[j] >> 6;
+        const int dr = (to / 8 > from / 8) - (to / 8 < from / 8);
+        const int dc = (to % 8 > from % 8) - (to % 8 < from % 8);
+        bool blocked = false;
+        if (abs(to / 8 - from / 8) == abs(to % 8 - from % 8) ||
+            to / 8 == from / 8 || to % 8 == from % 8) // not a knight move
+            for (int sq = from + dr * 8 + dc; sq != to && !blocked; sq += dr * 8 + dc)
+                blocked = board[sq] != Empty;
+        if (!blocked)
             return true;
     }
     return false;
 }
 
-thread ai_thread;
-
-void parse_and_make_moves(istringstream &iss, Board &board,
-                          vector<uint64_t> &repetitions)
+// batch evaluation
+// reads one FEN per line and writes one result line per FEN, in input order:
+//   eval <cp>                                  (static eval only)
+//   eval <cp> score <cp|mate> <n> bestmove <m> (with a fixed-depth search)
+//   invalid                                    (FEN could not be parsed)
+// scores are from the side to move's point of view
+string batch_eval_fen(Search &ai, const string &fen, int depth)
 {
-    string token;
-    while (iss >> token)
+    if (!ai.board.load_fen(fen))
+        return "invalid";
+
+    ostringstream result;
+    result << "eval " << ai.eval<false>() * ai.board.turn;
+    if (depth > 0)
     {
-        if (make_move_if_legal(board, token))
-            repetitions.push_back(board.zobrist_hash());
+        if (generate_legal_moves(ai.board).size() == 0)
+        { // checkmate or stalemate, nothing to search
+            result << (is_in_check(ai.board, ai.board.turn) ? " score mate 0"
+                                                             : " score cp 0");
+            result << " bestmove 0000";
+        }
         else
-            break;
+        {
+            ai.repetitions.clear();
+            ai.search_type = Fixed_depth;
+            ai.max_depth = depth;
+            ai.searching = true;
+            auto [bestmove, score] = ai.search();
+            print_score(result, score);
+            result << " bestmove " << bestmove.to_uci();
+        }
     }
+    return result.str();
 }
 
-void uci_loop()
+// batches are split in chunks that workers finish in any order, this
+// writes their results in the order of the chunks
+class OrderedWriter
 {
-    Search ai;
-    auto &board = ai.board;
-    auto &repetitions = ai.repetitions;
-    string line, token;
+public:
+    size_t written = 0; // results
 
-    while (getline(cin, line))
+    OrderedWriter(ostream &out) : out(out) {}
+    void write(size_t chunk, vector<string> results);
+
+private:
+    ostream &out;
+    mutex m;
+    map<size_t, vector<string>> finished;
+    size_t next = 0;
+};
+
+void OrderedWriter::write(size_t chunk, vector<string> results)
+{
+    lock_guard<mutex> lock(m);
+    written += results.size();
+    finished.emplace(chunk, std::move(results));
+    for (auto it = finished.find(next); it != finished.end();
+         it = finished.find(++next))
     {
-        istringstream iss(line);
-        iss >> token;
-        if (token[0] == '#')
-            continue; // ignore comments
+        for (auto &result : it->second)
+            out << result << "\n";
+        finished.erase(it);
+    }
+}
 
-        if (token == "uci")
-        {
-            cout << "uciok" << "\n";
-        }
-        else if (token == "ucinewgame")
-        {
-        }
-        else if (token == "position")
+size_t batch_eval(istream &in, ostream &out, int threads, int depth)
+{
+    // FENs are handed out in chunks, finished chunks are written in order
+    const size_t chunk_size = 256;
+    mutex in_mutex;
+    OrderedWriter writer(out);
+    size_t next_chunk = 0;
+    bool eof = false;
+
+    auto worker = [&]()
+    {
+        Search ai; // each worker evaluates on its own board and TT
+        ai.out = &null_stream;
+        vector<string> fens;
+        fens.reserve(chunk_size);
+        while (true)
         {
-            iss >> token;
-            repetitions.clear();
-            if (token == "fen")
+            size_t chunk;
+            fens.clear();
             {
-                string fen;
-                for (int i = 0; i < 6; i++)
+                lock_guard<mutex> lock(in_mutex);
+                if (eof)
+                    return;
+                string line;
+                while (fens.size() < chunk_size && getline(in, line))
                 {
-                    if (iss >> token && token != "moves")
-                        fen += token + " ";
-                    else
-                        break;
+                    if (line == "end")
+                        break; // end of FENs when reading from the command stream
+                    if (line != "" && line[0] != '#')
+                        fens.push_back(line);
                 }
-                // cout << "--\n{" << fen << "}\n--\n";
-                board.load_fen(fen);
-            }
-            else if (token == "startpos")
-            {
-                repetitions.clear();
-                board.load_startpos();
+                if (fens.size() < chunk_size)
+                    eof = true;
+                chunk = next_chunk++;
             }
-            iss >> token;
-            if (token == "moves")
-                parse_and_make_moves(iss, board, repetitions);
+
+            vector<string> results;
+            results.reserve(fens.size());
+            for (auto &fen : fens)
+                results.push_back(batch_eval_fen(ai, fen, depth));
+            writer.write(chunk, std::move(results));
         }
-        else if (token == "go")
+    };
+
+    vector<thread> pool;
+    for (int i = 0; i < max(threads, 1); i++)
+        pool.emplace_back(worker);
+    for (auto &t : pool)
+        t.join();
+    out.flush();
+    return writer.written;
+}
+
+// evalbatch [file <path>] [out <path>] [depth <n>] [threads <n>]
+// without a file, FENs are read from stdin until "end" or EOF
+void batch_eval_command(istringstream &iss)
+{
+    string token, in_path, out_path;
+    int depth = 0, threads = max(1u, thread::hardware_concurrency());
+    while (iss >> token)
+    {
+        if (token == "file")
+            iss >> in_path;
+        else if (token == "out")
+            iss >> out_path;
+        else if (token == "depth")
+            iss >> depth;
+        else if (token == "threads")
+            iss >> threads;
+    }
+
+    ifstream in_file;
+    ofstream out_file;
+    if (in_path != "")
+    {
+        in_file.open(in_path);
+        if (!in_file)
         {
-            // example: go wtime 56329 btime 86370 winc 1000 binc 1000
-            repetitions.clear();
-            ai.search_type = Time_per_game;
-            ai.set_clock(30000, 30000, 0, 0);
-            ai.max_depth = 100;
-            while (iss >> token)
-            {
-                if (token == "searchmoves")
-                {
-                }
-                else if (token == "ponder")
-                {
-                    ai.search_type = Ponder;
-                }
-                else if (token == "wtime")
-                {
-                    iss >> ai.wtime;
-                }
-                else if (token == "btime")
-                {
-                    iss >> ai.btime;
-                }
-                else if (token == "winc")
-                {
-                    iss >> ai.winc;
-                }
-                else if (token == "binc")
-                {
-                    iss >> ai.binc;
-                }
-                else if (token == "movestogo")
-                {
-                }
-                else if (token == "depth")
-                {
-                    iss >> ai.max_depth;
-                    ai.search_type = Fixed_depth;
-                }
-                else if (token == "nodes")
-                {
-                }
-                else if (token == "mate")
-                {
-                    ai.search_type = Mate;
-                }
-                else if (token == "movetime")
-                {
-                    iss >> ai.mtime;
-                    ai.search_type = Time_per_move;
-                }
-                else if (token == "infinite")
-                {
-                    ai.search_type = Infinite;
-                }
-                else if (token == "startpos")
-                {
-                    board.load_startpos();
-                    iss >> token;
-                    if (token == "moves")
-                        parse_and_make_moves(iss, board, repetitions);
-                }
-                else if (token == "perft")
-                {
-                    iss >> token;
-                    if (!ai.searching)
-                    {
-                        if (ai_thread.joinable())
-                            ai_thread.join();
-                        ai_thread = thread([&]()
-                                           { divide(board, stoi(token)); });
-                    }
-                }
+            cout << "info string cannot open " << in_path << "\n";
+            return;
+        }
+    }
+    if (out_path != "")
+        out_file.open(out_path);
+
+    const auto start_time = chrono::high_resolution_clock::now();
+    size_t n = batch_eval(in_path != "" ? (istream &)in_file : cin,
+                          out_path != "" ? (ostream &)out_file : cout, threads,
+                          depth);
+    auto time_taken = chrono::duration_cast<chrono::milliseconds>(
+                          chrono::high_resolution_clock::now() - start_time)
+                          .count();
+    cerr << "info string evaluated " << n << " positions in " << time_taken
+         << " ms using " << threads << " threads" << "\n";
+}
+
+// the FEN of an EPD or FEN line, move counters added if missing, and the
+// EPD operations that follow it, e.g. bm Nf3; id "WAC.001";
+// "" if the line has less than four fields
+string epd_fen(const string &line, string &operations)
+{
+    istringstream iss(line);
+    string field, fen;
+    for (int i = 0; i < 4; i++)
+    {
+        if (!(iss >> field))
+            return "";
+        fen += (i ? " " : "") + field;
+    }
+    auto pos = iss.tellg();
+    string fifty, moves;
+    if (iss >> fifty >> moves &&
+        all_of(fifty.begin(), fifty.end(), ::isdigit) &&
+        all_of(moves.begin(), moves.end(), ::isdigit))
+    {
+        fen += " " + fifty + " " + moves;
+        pos = iss.tellg();
+    }
+    else
+        fen += " 0 1";
+    operations = pos < 0 ? "" : line.substr(pos);
+    operations.erase(0, operations.find_first_not_of(" \t"));
+    return fen;
+}
+
+// the operations of an EPD line by opcode, e.g. {"bm": {"Nf3", "e4"}} for
+// bm Nf3 e4; quotes are removed from the operands
+map<string, vector<string>> epd_operations(const string &operations)
+{
+    map<string, vector<string>> ops;
+    string opcode, operand;
+    bool quoted = false;
+    vector<string> operands;
+    auto end_operand = [&]()
+    {
+        if (opcode == "")
+            opcode = operand;
+        else if (operand != "")
+            operands.push_back(operand);
+        operand = "";
+    };
+    for (char c : operations)
+    {
+        if (c == '"')
+            quoted = !quoted;
+        else if (quoted)
+            operand += c;
+        else if (c == ' ' || c == '\t' || c == ';')
+        {
+            end_operand();
+            if (c == ';' && opcode != "")
+            {
+                ops[opcode] = operands;
+                opcode = "";
+                operands.clear();
             }
-            if (!ai.searching)
+        }
+        else
+            operand += c;
+    }
+    end_operand();
+    if (opcode != "")
+        ops[opcode] = operands;
+    return ops;
+}
+
+// batch search limits, a search stops at the first one reached
+struct BatchLimits
+{
+    int depth = 0;
+    int movetime = 0; // ms
+    uint64_t nodes = 0;
+};
+
+// one result line per position:
+//   bestmove <m> score <cp|mate> <n> depth <d> nodes <n> pv <moves>
+//   invalid    (the FEN could not be parsed)
+// scores are from the side to move's point of view
+string batch_search_fen(Search &ai, const string &line, const BatchLimits &limits)
+{
+    string operations;
+    const string fen = epd_fen(line, operations);
+    if (fen == "" || !ai.board.load_fen(fen))
+        return "invalid";
+
+    ostringstream result;
+    if (generate_legal_moves(ai.board).size() == 0)
+    { // checkmate or stalemate, nothing to search
+        result << "bestmove 0000"
+               << (is_in_check(ai.board, ai.board.turn) ? " score mate 0"
+                                                        : " score cp 0")
+               << " depth 0 nodes 0 pv";
+        return result.str();
+    }
+    ai.repetitions.clear();
+    ai.search_moves.clear();
+    ai.pondering = false;
+    ai.max_depth = limits.depth ? limits.depth : 100;
+    ai.max_nodes = limits.nodes;
+    ai.mtime = limits.movetime;
+    ai.search_type = limits.movetime ? Time_per_move
+                     : limits.depth  ? Fixed_depth
+                                     : Infinite;
+    ai.searching = true;
+    auto [bestmove, score] = ai.search();
+    result << "bestmove " << bestmove.to_uci();
+    print_score(result, score);
+    result << " depth "
+           << (ai.iteration_stats.size() ? ai.iteration_stats.back().depth : 0)
+           << " nodes " << ai.nodes_searched << " pv " << pv_string(ai.pv);
+    return result.str();
+}
+
+// searches the positions of data, one per line, on threads workers, each
+// with its own search and, unless shared_hash, its own TT. Workers take
+// fixed size byte ranges and search the lines that start in them
+size_t batch_search(const char *data, size_t size, ostream &out, int threads,
+                    const BatchLimits &limits, bool shared_hash)
+{
+    const size_t chunk_bytes = 1 << 14;
+    const size_t chunks = (size + chunk_bytes - 1) / chunk_bytes;
+    atomic<size_t> next_chunk{0};
+    OrderedWriter writer(out);
+    TT_t shared_TT = nullptr;
+    if (shared_hash)
+        init_TT(shared_TT, TT_entries_for(1));
+
+    // the first line start at or after pos
+    auto line_start = [&](size_t pos)
+    {
+        if (pos == 0 || pos >= size)
+            return min(pos, size);
+        auto *newline = (const char *)memchr(data + pos - 1, '\n', size - pos + 1);
+        return newline ? size_t(newline - data + 1) : size;
+    };
+
+    auto worker = [&]()
+    {
+        Search ai(shared_TT);
+        ai.out = &null_stream;
+        for (size_t chunk; (chunk = next_chunk++) < chunks;)
+        {
+            size_t pos = line_start(chunk * chunk_bytes);
+            const size_t end = line_start((chunk + 1) * chunk_bytes);
+            vector<string> results;
+            while (pos < end)
+            {
+                auto *newline = (const char *)memchr(data + pos, '\n', end - pos);
+                const size_t line_end = newline ? newline - data : end;
+                string line(data + pos, line_end - pos);
+                pos = line_end + 1;
+                if (line.size() && line.back() == '\r')
+                    line.pop_back();
+                if (line != "" && line[0] != '#')
+                    results.push_back(batch_search_fen(ai, line, limits));
+            }
+            writer.write(chunk, std::move(results));
+        }
+    };
+
+    vector<thread> pool;
+    for (int i = 0; i < max(threads, 1); i++)
+        pool.emplace_back(worker);
+    for (auto &t : pool)
+        t.join();
+    out.flush();
+    free_TT(shared_TT, TTAllocated);
+    return writer.written;
+}
+
+// batch <file> [out <path>] [depth <n>] [nodes <n>] [movetime <ms>]
+//       [threads <n>] [sharedhash]
+// searches every FEN or EPD line of the file, depth 8 without limits
+void batch_command(istringstream &iss)
+{
+    string token, in_path, out_path;
+    BatchLimits limits;
+    int threads = max(1u, thread::hardware_concurrency());
+    bool shared_hash = false;
+    iss >> in_path;
+    while (iss >> token)
+    {
+        if (token == "out")
+            iss >> out_path;
+        else if (token == "depth")
+            iss >> limits.depth;
+        else if (token == "nodes")
+            iss >> limits.nodes;
+        else if (token == "movetime")
+            iss >> limits.movetime;
+        else if (token == "threads")
+            iss >> threads;
+        else if (token == "sharedhash")
+            shared_hash = true;
+    }
+    if (!limits.depth && !limits.nodes && !limits.movetime)
+        limits.depth = 8;
+
+    const int fd = open(in_path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        cout << "info string cannot open " << in_path << "\n";
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    const size_t size = st.st_size;
+    void *data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        cout << "info string cannot map " << in_path << "\n";
+        return;
+    }
+    if (size)
+        madvise(data, size, MADV_SEQUENTIAL);
+
+    ofstream out_file;
+    if (out_path != "")
+        out_file.open(out_path);
+    const auto start_time = chrono::high_resolution_clock::now();
+    const size_t n = batch_search((const char *)data, size,
+                                  out_path != "" ? (ostream &)out_file : cout,
+                                  threads, limits, shared_hash);
+    const auto time_taken = chrono::duration_cast<chrono::milliseconds>(
+                                chrono::high_resolution_clock::now() - start_time)
+                                .count();
+    if (size)
+        munmap(data, size);
+    cerr << "info string searched " << n << " positions in " << time_taken
+         << " ms using " << threads << " threads" << "\n";
+}
+
+struct SuiteResult
+{
+    bool valid = false, solved = false;
+    int time = 0; // ms to the solution, if solved
+    string line;
+};
+
+// searches an EPD position with bm (best moves) and/or am (avoid moves) for
+// movetime ms. It's solved if the final move is right, at the time of the
+// iteration from which on the best move was always right
+SuiteResult suite_position(Search &ai, const string &line, size_t number, int movetime)
+{
+    SuiteResult result;
+    string operations;
+    const string fen = epd_fen(line, operations);
+    auto ops = epd_operations(operations);
+    const string id = ops.count("id") && ops["id"].size() ? ops["id"][0]
+                                                          : "#" + to_string(number);
+    if (fen == "" || !ai.board.load_fen(fen) ||
+        (!ops.count("bm") && !ops.count("am")) ||
+        generate_legal_moves(ai.board).size() == 0)
+    {
+        result.line = id + " invalid";
+        return result;
+    }
+
+    vector<Move> best, avoid;
+    string expected;
+    for (auto [opcode, moves] : {pair{"bm", &best}, pair{"am", &avoid}})
+        for (auto &san : ops[opcode])
+        {
+            Move move = get_move_from_san(ai.board, san);
+            if (move.equals(0, 0))
+            {
+                result.line = id + " invalid " + opcode + " " + san;
+                return result;
+            }
+            moves->push_back(move);
+            expected += string(" ") + opcode + " " + san;
+        }
+    auto correct = [&](Move &move)
+    {
+        auto contains = [&](vector<Move> &moves)
+        {
+            return any_of(moves.begin(), moves.end(), [&](Move &m)
+                          { return m.equals(move) && m.promotion == move.promotion; });
+        };
+        return (best.empty() || contains(best)) && !contains(avoid);
+    };
+
+    // every position starts from scratch, so its time doesn't depend on
+    // which positions the worker searched before
+    ai.new_game();
+    ai.repetitions.clear();
+    ai.search_moves.clear();
+    ai.pondering = false;
+    ai.max_depth = 100;
+    ai.max_nodes = 0;
+    ai.mtime = movetime;
+    ai.search_type = Time_per_move;
+    ai.searching = true;
+    Board board = ai.board;
+    auto [bestmove, score] = ai.search();
+
+    result.valid = true;
+    result.solved = correct(bestmove);
+    if (result.solved)
+    {
+        result.time = ai.iteration_stats.size() ? ai.iteration_stats.back().time : 0;
+        for (auto it = ai.iteration_stats.rbegin();
+             it != ai.iteration_stats.rend() && correct(it->bestmove); it++)
+            result.time = it->time;
+    }
+    ostringstream out;
+    out << id;
+    if (result.solved)
+        out << " solved " << result.time << " ms";
+    else
+        out << " failed";
+    out << " bestmove " << to_san(board, bestmove);
+    print_score(out, score);
+    out << " depth "
+        << (ai.iteration_stats.size() ? ai.iteration_stats.back().depth : 0)
+        << " expected" << expected;
+    result.line = out.str();
+    return result;
+}
+
+// epdsuite <file> <movetime> [threads <n>]
+// runs an EPD test suite (WAC, STS, ...) and prints each position's result,
+// then the solve rate and the time to solution of the solved positions.
+// Positions are searched in parallel, one thread each
+void epdsuite_command(istringstream &iss)
+{
+    string path, token;
+    int movetime = 0;
+    int threads = max(1u, thread::hardware_concurrency());
+    iss >> path >> movetime;
+    while (iss >> token)
+        if (token == "threads")
+            iss >> threads;
+    ifstream in(path);
+    if (!in || movetime <= 0)
+    {
+        cout << "info string usage: epdsuite <file> <movetime> [threads <n>]" << "\n";
+        return;
+    }
+    vector<string> lines;
+    string line;
+    while (getline(in, line))
+    {
+        if (line.size() && line.back() == '\r')
+            line.pop_back();
+        if (line != "" && line[0] != '#')
+            lines.push_back(line);
+    }
+
+    vector<SuiteResult> results(lines.size());
+    atomic<size_t> next{0};
+    OrderedWriter writer(cout);
+    auto worker = [&]()
+    {
+        Search ai;
+        ai.out = &null_stream;
+        for (size_t i; (i = next++) < lines.size();)
+        {
+            results[i] = suite_position(ai, lines[i], i + 1, movetime);
+            writer.write(i, {"info string " + results[i].line});
+        }
+    };
+    vector<thread> pool;
+    for (int i = 0; i < max(threads, 1); i++)
+        pool.emplace_back(worker);
+    for (auto &t : pool)
+        t.join();
+
+    vector<int> times;
+    size_t valid = 0;
+    for (auto &result : results)
+    {
+        valid += result.valid;
+        if (result.solved)
+            times.push_back(result.time);
+    }
+    sort(times.begin(), times.end());
+    const double mean =
+        times.size() ? accumulate(times.begin(), times.end(), 0.0) / times.size() : 0;
+    const double median =
+        times.empty() ? 0
+        : times.size() % 2
+            ? times[times.size() / 2]
+            : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2.0;
+    cout << "info string solved " << times.size() << " of " << valid << " ("
+         << fixed << setprecision(1) << (valid ? 100.0 * times.size() / valid : 0.0)
+         << "%) at " << movetime << " ms, time to solution mean "
+         << setprecision(0) << mean << " ms median " << median << " ms";
+    if (valid < results.size())
+        cout << ", " << results.size() - valid << " invalid";
+    cout << "\n"
+         << defaultfloat << setprecision(6);
+}
+
+void ThreadPool::resize(int n)
+{
+    wait();
+    {
+        lock_guard<mutex> lock(m);
+        for (size_t i = n; i < workers.size(); i++)
+            workers[i]->quit = true;
+    }
+    wakeup.notify_all();
+    while (int(workers.size()) > n)
+    {
+        workers.back()->th.join();
+        workers.pop_back();
+    }
+    while (int(workers.size()) < n)
+    {
+        workers.push_back(make_unique<Worker>());
+        auto &worker = *workers.back();
+        worker.th = thread([this, &worker]()
+                           { loop(worker); });
+    }
+}
+
+void ThreadPool::run(int i, function<void()> job)
+{
+    {
+        lock_guard<mutex> lock(m);
+        workers[i]->job = job;
+    }
+    wakeup.notify_all();
+}
+
+void ThreadPool::wait()
+{
+    unique_lock<mutex> lock(m);
+    idle.wait(lock, [this]()
+              {
+                  for (auto &worker : workers)
+                      if (worker->job)
+                          return false;
+                  return true; });
+}
+
+void ThreadPool::loop(Worker &worker)
+{
+    unique_lock<mutex> lock(m);
+    while (true)
+    {
+        wakeup.wait(lock, [&]()
+                    { return worker.quit || worker.job; });
+        if (worker.quit)
+            return;
+        lock.unlock();
+        worker.job();
+        lock.lock();
+        worker.job = nullptr;
+        idle.notify_all();
+    }
+}
+
+
+void parse_and_make_moves(istringstream &iss, Board &board,
+                          vector<uint64_t> &repetitions)
+{
+    string token;
+    while (iss >> token)
+    {
+        const uint64_t hash = board.zobrist_hash();
+        if (make_move_if_legal(board, token))
+            repetitions.push_back(hash);
+        else
+            break;
+    }
+}
+
+// default_value is what uci reports, value may have been set already
+struct SpinOption
+{
+    string name;
+    int *value;
+    int default_value, min, max;
+};
+
+struct CheckOption
+{
+    string name;
+    bool *value;
+    bool default_value;
+};
+
+vector<CheckOption> check_options(Search &ai)
+{
+    return {
+        {"Ponder", &ai.ponder, false},
+        {"UpcomingRepetition", &ai.upcoming_repetition, true},
+    };
+}
+
+// search parameters exposed through setoption
+vector<SpinOption> spin_options(Search &ai)
+{
+    return {
+        {"Threads", &ai.threads, 1, 1, 256},
+        {"NullMoveMinDepth", &ai.null_move_min_depth, 3, 1, 64},
+        {"NullMoveReduction", &ai.null_move_reduction, 3, 1, 8},
+        {"LMRMinDepth", &ai.lmr_min_depth, 3, 1, 64},
+        {"LMRMinMoves", &ai.lmr_min_moves, 3, 1, 64},
+        {"LMRBase", &ai.lmr_base, 75, 0, 300},
+        {"LMRDivisor", &ai.lmr_divisor, 225, 50, 1000},
+        {"RFPMaxDepth", &ai.rfp_max_depth, 6, 0, 64},
+        {"RFPMargin", &ai.rfp_margin, 100, 0, 1000},
+        {"FutilityMaxDepth", &ai.futility_max_depth, 3, 0, 64},
+        {"FutilityMargin", &ai.futility_margin, 150, 0, 1000},
+        {"AspirationWindow", &ai.aspiration_window, 50, 1, 1000},
+        {"MultiPV", &ai.multi_pv, 1, 1, 256},
+    };
+}
+
+string lowercase(string s)
+{
+    transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+// setoption name <id> [value <x>], option names are case insensitive,
+// false if there's no such option
+bool set_option(Search &ai, istringstream &iss, ostream &out = cout)
+{
+    string token, name, value;
+    iss >> token; // name
+    while (iss >> token && token != "value")
+        name += (name == "" ? "" : " ") + token;
+    getline(iss >> ws, value);
+
+    // a table in shared memory, the searches of other processes use it too,
+    // or in a file that keeps it across restarts
+    if (lowercase(name) == "sharedhash" || lowercase(name) == "hashfile")
+    {
+        string error;
+        if (ai.searching)
+            out << "info string can't change the hash while searching" << "\n";
+        else if (!ai.set_mapped_hash(value == "<empty>" ? "" : value,
+                                     lowercase(name) == "hashfile", error))
+            out << "info string " << error << "\n";
+        return true;
+    }
+    // MB, our own table is replaced by an empty one of that size
+    if (lowercase(name) == "hash")
+    {
+        if (ai.searching)
+        {
+            out << "info string can't change the hash while searching" << "\n";
+            return true;
+        }
+        try
+        {
+            ai.set_hash_size(stoi(value));
+        }
+        catch (const bad_alloc &)
+        {
+            out << "info string can't allocate " << value << " MB" << "\n";
+        }
+        catch (...)
+        {
+            out << "info string invalid value for Hash" << "\n";
+        }
+        return true;
+    }
+    for (auto &option : check_options(ai))
+    {
+        if (lowercase(option.name) != lowercase(name))
+            continue;
+        if (lowercase(value) == "true" || lowercase(value) == "false")
+            *option.value = lowercase(value) == "true";
+        else
+            out << "info string invalid value for " << option.name << "\n";
+        return true;
+    }
+    for (auto &option : spin_options(ai))
+    {
+        if (lowercase(option.name) != lowercase(name))
+            continue;
+        try
+        {
+            *option.value = max(option.min, min(option.max, stoi(value)));
+        }
+        catch (...)
+        {
+            out << "info string invalid value for " << option.name << "\n";
+            return true;
+        }
+        ai.init_reductions(); // in case an LMR parameter changed
+        return true;
+    }
+    out << "info string unknown option " << name << "\n";
+    return false;
+}
+
+int LineCallbackBuf::overflow(int c)
+{
+    if (c == traits_type::eof())
+        return traits_type::not_eof(c);
+    if (c != '\n')
+        line += char(c);
+    else
+    {
+        if (callback)
+            callback(line);
+        line.clear();
+    }
+    return c;
+}
+
+// log lines: <fen> ; key <k> depth <d> score <s> time <ms> nodes <n> pv <moves>
+bool AnalysisCache::open(const string &path)
+{
+    lock_guard<mutex> lock(m);
+    lru.clear();
+    index.clear();
+    log.close();
+    on = true;
+    if (path.empty())
+        return true;
+
+    ifstream in(path);
+    string line, token;
+    while (getline(in, line))
+    {
+        const size_t separator = line.find(" ; ");
+        if (separator == string::npos)
+            continue;
+        CachedAnalysis analysis;
+        analysis.fen = line.substr(0, separator);
+        istringstream iss(line.substr(separator + 3));
+        while (iss >> token)
+        {
+            if (token == "key")
+                iss >> hex >> analysis.key >> dec;
+            else if (token == "depth")
+                iss >> analysis.depth;
+            else if (token == "score")
+                iss >> analysis.score;
+            else if (token == "time")
+                iss >> analysis.time;
+            else if (token == "nodes")
+                iss >> analysis.nodes;
+            else if (token == "pv")
+                while (iss >> token)
+                    analysis.pv.push_back(token);
+        }
+        if (analysis.pv.size())
+            insert(analysis);
+    }
+    log.open(path, ios::app);
+    return bool(log);
+}
+
+void AnalysisCache::close()
+{
+    lock_guard<mutex> lock(m);
+    on = false;
+    lru.clear();
+    index.clear();
+    log.close();
+}
+
+bool AnalysisCache::lookup(uint64_t key, const string &fen, int depth,
+                           int time, CachedAnalysis &analysis)
+{
+    lock_guard<mutex> lock(m);
+    auto it = index.find(key);
+    if (it == index.end() || it->second->fen != fen ||
+        it->second->depth < depth || it->second->time < time)
+    {
+        misses++;
+        return false;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    analysis = lru.front();
+    hits++;
+    return true;
+}
+
+void AnalysisCache::store(const CachedAnalysis &analysis)
+{
+    lock_guard<mutex> lock(m);
+    insert(analysis);
+    stores++;
+    if (!log.is_open())
+        return;
+    log << analysis.fen << " ; key " << hex << analysis.key << dec << " depth "
+        << analysis.depth << " score " << analysis.score << " time "
+        << analysis.time << " nodes " << analysis.nodes << " pv";
+    for (auto &move : analysis.pv)
+        log << " " << move;
+    log << "\n"
+        << flush;
+}
+
+// keeps the deeper of two results for a position
+void AnalysisCache::insert(const CachedAnalysis &analysis)
+{
+    auto it = index.find(analysis.key);
+    if (it != index.end())
+    {
+        auto &old = *it->second;
+        if (old.fen == analysis.fen && old.depth > analysis.depth &&
+            old.time >= analysis.time)
+            return;
+        lru.erase(it->second);
+    }
+    lru.push_front(analysis);
+    index[analysis.key] = lru.begin();
+    while (lru.size() > capacity)
+    {
+        index.erase(lru.back().key);
+        lru.pop_back();
+        evictions++;
+    }
+}
+
+void AnalysisCache::print_stats(ostream &out)
+{
+    lock_guard<mutex> lock(m);
+    const uint64_t lookups = hits + misses;
+    out << "info string analysis cache " << (on ? "on" : "off") << ", "
+        << lru.size() << " of " << capacity << " results in memory" << "\n";
+    out << "info string lookups " << lookups << " hits " << hits << " ("
+        << (lookups ? 100 * hits / lookups : 0) << "%) misses " << misses
+        << " stores " << stores << " evictions " << evictions << "\n";
+}
+
+// the cache key of the search's result, 0 if it can't be cached. The
+// cache only answers and keeps searches of the whole position with one
+// line. Repetitions make the result depend on the reversible moves that
+// led to the position, so their keys are mixed in. Near the fifty move
+// draw a search line can reach it, those results aren't kept at all
+uint64_t analysis_key(Search &ai)
+{
+    if (ai.search_type == Mate || ai.pondering || ai.multi_pv != 1 ||
+        ai.search_moves.size() || ai.max_nodes ||
+        ai.board.fifty > 100 - MAX_PLY / 2)
+        return 0;
+    uint64_t key = ai.board.zobrist_hash();
+    const size_t n = min<size_t>(ai.board.fifty, ai.repetitions.size());
+    for (size_t i = ai.repetitions.size() - n; i < ai.repetitions.size(); i++)
+        key = (key ^ ai.repetitions[i]) * 0x9e3779b97f4a7c15;
+    return key ? key : 1;
+}
+
+// the first four fields of the FEN, without the move counters
+string analysis_position(Board &board)
+{
+    const string fen = board.to_fen();
+    return fen.substr(0, fen.rfind(' ', fen.rfind(' ') - 1));
+}
+
+// answers a depth or movetime search from the cache, writing the info and
+// bestmove lines the search would have to ai.out
+bool cached_search(AnalysisCache &cache, Search &ai, uint64_t key,
+                   pair<Move, int> &result)
+{
+    CachedAnalysis cached;
+    if (!key ||
+        (ai.search_type != Fixed_depth && ai.search_type != Time_per_move) ||
+        !cache.lookup(key, analysis_position(ai.board),
+                      ai.search_type == Fixed_depth ? ai.max_depth : 0,
+                      ai.search_type == Time_per_move ? ai.mtime : 0, cached))
+        return false;
+
+    auto move = get_move_if_legal(ai.board, cached.pv[0]);
+    *ai.out << "info string analysis cache hit" << "\n";
+    *ai.out << "info depth " << cached.depth;
+    print_score(*ai.out, cached.score);
+    *ai.out << " nodes " << cached.nodes << " time 0 pv";
+    for (auto &m : cached.pv)
+        *ai.out << " " << m;
+    *ai.out << "\n"
+            << "bestmove " << cached.pv[0];
+    if (cached.pv.size() > 1)
+        *ai.out << " ponder " << cached.pv[1];
+    *ai.out << "\n";
+    result = {move, cached.score};
+    return true;
+}
+
+// keeps the result of a finished search of type, which is what it was
+// started with. A movetime search that was stopped doesn't stand for its
+// movetime
+void cache_result(AnalysisCache &cache, Search &ai, uint64_t key,
+                  const string &position, SearchType type, int score,
+                  bool stopped)
+{
+    if (!key || ai.pv.empty() || ai.iteration_stats.empty())
+        return;
+    auto &last = ai.iteration_stats.back();
+    CachedAnalysis analysis;
+    analysis.key = key;
+    analysis.fen = position;
+    analysis.depth = last.depth;
+    analysis.score = score;
+    analysis.time = last.time;
+    if (type == Time_per_move && !stopped)
+        analysis.time = max(analysis.time, min(ai.mtime, ai.max_time));
+    analysis.nodes = last.nodes;
+    for (auto &move : ai.pv)
+        analysis.pv.push_back(move.to_uci());
+    cache.store(analysis);
+}
+
+Engine::Engine() : pool(1), line_stream(&lines) {}
+
+Engine::~Engine() { stop(); }
+
+void Engine::set_threads(int n)
+{
+    stop();
+    ai.threads = n;
+    pool.resize(n);
+    helpers.clear();
+    for (int i = 1; i < n; i++)
+    {
+        helpers.push_back(make_unique<Search>(ai.TT));
+        helpers.back()->helper_id = i;
+        helpers.back()->out = &null_stream;
+    }
+}
+
+// lazy SMP: the helpers search the same position and only communicate
+// through the shared TT, the main search decides the move
+void Engine::start(function<void(const string &)> on_line)
+{
+    pool.wait();
+    lines.callback = on_line;
+    ai.out = on_line ? &line_stream : &cout;
+
+    const uint64_t key = cache.enabled() ? analysis_key(ai) : 0;
+    if (cached_search(cache, ai, key, result))
+        return;
+    const string position = key ? analysis_position(ai.board) : "";
+
+    busy = true;
+    ai.searching = true;
+    ai.helpers.clear();
+    for (auto &helper : helpers)
+    {
+        ai.helpers.push_back(helper.get());
+        helper->board = ai.board;
+        helper->repetitions = ai.repetitions;
+        helper->search_moves = ai.search_moves;
+        helper->max_depth = ai.max_depth;
+        helper->search_type = Infinite; // until the main search stops it
+        helper->generation = ai.generation;
+        helper->upcoming_repetition = ai.upcoming_repetition;
+        auto from = spin_options(ai), to = spin_options(*helper);
+        for (size_t i = 0; i < from.size(); i++)
+            *to[i].value = *from[i].value;
+        helper->init_reductions();
+        helper->multi_pv = 1;
+        helper->searching = true;
+    }
+    stop_requested = false;
+    pool.run(0, [this, key, position]()
+             {
+                 for (size_t i = 0; i < helpers.size(); i++)
+                     pool.run(i + 1, [this, i]()
+                              { helpers[i]->search(); });
+                 const SearchType type = ai.search_type;
+                 result = ai.search();
+                 for (auto &helper : helpers)
+                     helper->searching = false;
+                 cache_result(cache, ai, key, position, type, result.second,
+                              stop_requested);
+                 busy = false; });
+}
+
+void Engine::run(function<void()> job)
+{
+    pool.wait();
+    busy = true;
+    pool.run(0, [this, job]()
+             {
+                 job();
+                 busy = false; });
+}
+
+void Engine::stop()
+{
+    if (ai.searching)
+        stop_requested = true; // the result doesn't stand for the movetime
+    ai.searching = false;
+    pool.wait();
+}
+
+void Engine::wait() { pool.wait(); }
+
+// trace on <file> [size <records>] [sample <n>] [mindepth <d>] | trace off
+// searches of the main thread are recorded until trace off
+void trace_command(Search &ai, Tracer &tracer, istringstream &iss)
+{
+    string token, path;
+    iss >> token;
+    if (token == "off")
+    {
+        cout << "info string trace recorded " << tracer.written() << " nodes"
+             << "\n";
+        tracer.close();
+        ai.tracer = nullptr;
+        return;
+    }
+    if (token != "on" || !(iss >> path))
+    {
+        cout << "info string usage: trace on <file> [size <records>] "
+                "[sample <n>] [mindepth <d>] | trace off"
+             << "\n";
+        return;
+    }
+
+    uint64_t size = 1 << 20;
+    tracer.sample = 1;
+    tracer.min_depth = 1;
+    while (iss >> token)
+    {
+        if (token == "size")
+            iss >> size;
+        else if (token == "sample")
+            iss >> tracer.sample;
+        else if (token == "mindepth")
+            iss >> tracer.min_depth;
+    }
+    tracer.sample = max(tracer.sample, 1);
+    if (!tracer.open(path, max<uint64_t>(size, 1)))
+    {
+        cout << "info string can't open trace file " << path << "\n";
+        ai.tracer = nullptr;
+        return;
+    }
+    ai.tracer = &tracer;
+}
+
+// profile [depth <n>]: a fixed depth search on this thread, as the counters
+// are thread local, then each section's share of the search time
+void profile_command([[maybe_unused]] Search &ai,
+                     [[maybe_unused]] istringstream &iss)
+{
+#ifdef PROFILE
+    string token;
+    int depth = 8;
+    while (iss >> token)
+        if (token == "depth")
+            iss >> depth;
+
+    for (auto &counter : profile_counters)
+        counter = ProfileCounter();
+    ai.search_type = Fixed_depth;
+    ai.max_depth = depth;
+    ai.search_moves.clear();
+    ai.searching = true;
+    const uint64_t start = profile_ticks();
+    ai.search();
+    const uint64_t total = max<uint64_t>(profile_ticks() - start, 1);
+
+    cout << "info string profile of depth " << depth << " search, " << total
+         << " ticks, sections include nested ones" << "\n";
+    for (int i = 0; i < ProfileSections; i++)
+    {
+        auto &counter = profile_counters[i];
+        cout << "info string " << profile_names[i] << " calls " << counter.calls
+             << " ticks " << counter.ticks << " ticks/call "
+             << (counter.calls ? counter.ticks / counter.calls : 0) << " share "
+             << fixed << setprecision(1) << 100.0 * counter.ticks / total
+             << defaultfloat << setprecision(6) << "%" << "\n";
+    }
+#else
+    cout << "info string profiler not compiled in, build with -DPROFILE" << "\n";
+#endif
+}
+
+// position [startpos | fen <fen>] [moves <moves>]
+void position_command(Search &ai, istringstream &iss)
+{
+    auto &board = ai.board;
+    auto &repetitions = ai.repetitions;
+    string token;
+    iss >> token;
+    repetitions.clear();
+    if (token == "fen")
+    {
+        string fen;
+        for (int i = 0; i < 6; i++)
+        {
+            if (iss >> token && token != "moves")
+                fen += token + " ";
+            else
+                break;
+        }
+        board.load_fen(fen);
+    }
+    else if (token == "startpos")
+    {
+        board.load_startpos();
+    }
+    iss >> token;
+    if (token == "moves")
+        parse_and_make_moves(iss, board, repetitions);
+}
+
+// sets the search parameters of a go command, returns the depth of go perft
+// or 0 for a search
+int go_command(Search &ai, istringstream &iss)
+{
+    // example: go wtime 56329 btime 86370 winc 1000 binc 1000
+    auto &board = ai.board;
+    string token;
+    int perft_depth = 0;
+    ai.pondering = false;
+    ai.search_moves.clear();
+    ai.search_type = Time_per_game;
+    ai.set_clock(30000, 30000, 0, 0);
+    ai.max_depth = 100;
+    ai.max_nodes = 0;
+    while (iss >> token)
+    {
+        if (token == "searchmoves")
+        { // the moves run until the first token that isn't one
+            auto pos = iss.tellg();
+            while (iss >> token)
             {
-                if (ai_thread.joinable())
-                    ai_thread.join();
-                ai_thread = thread([&]()
-                                   { ai.search(); });
+                auto move = get_move_if_legal(board, token);
+                if (move.equals(0, 0))
+                {
+                    iss.seekg(pos);
+                    break;
+                }
+                ai.search_moves.push_back(move);
+                pos = iss.tellg();
             }
         }
+        else if (token == "ponder")
+        {
+            ai.pondering = true;
+        }
+        else if (token == "wtime")
+        {
+            iss >> ai.wtime;
+        }
+        else if (token == "btime")
+        {
+            iss >> ai.btime;
+        }
+        else if (token == "winc")
+        {
+            iss >> ai.winc;
+        }
+        else if (token == "binc")
+        {
+            iss >> ai.binc;
+        }
+        else if (token == "movestogo")
+        {
+        }
+        else if (token == "depth")
+        {
+            iss >> ai.max_depth;
+            ai.search_type = Fixed_depth;
+        }
+        else if (token == "nodes")
+        {
+            iss >> ai.max_nodes;
+            ai.search_type = Infinite; // until the nodes are searched
+        }
+        else if (token == "mate")
+        {
+            iss >> ai.mate_moves;
+            ai.search_type = Mate;
+        }
+        else if (token == "movetime")
+        {
+            iss >> ai.mtime;
+            ai.search_type = Time_per_move;
+        }
+        else if (token == "infinite")
+        {
+            ai.search_type = Infinite;
+        }
+        else if (token == "startpos")
+        {
+            board.load_startpos();
+            ai.repetitions.clear();
+            iss >> token;
+            if (token == "moves")
+                parse_and_make_moves(iss, board, ai.repetitions);
+        }
+        else if (token == "perft")
+        {
+            iss >> perft_depth;
+        }
+    }
+    return perft_depth;
+}
+
+// cache on [<log file>] | cache off | cache [stats]
+void cache_command(Engine &engine, istringstream &iss)
+{
+    string token, path;
+    iss >> token;
+    if (token == "on")
+    {
+        iss >> path;
+        if (engine.searching())
+            cout << "info string can't change the cache while searching" << "\n";
+        else if (!engine.cache.open(path))
+            cout << "info string can't open " << path << "\n";
+    }
+    else if (token == "off")
+    {
+        if (!engine.searching())
+            engine.cache.close();
+    }
+    engine.cache.print_stats(cout);
+}
+
+// savehash <file> [mindepth <d>] | loadhash <file>
+void hash_file_command(Search &ai, const string &command, istringstream &iss)
+{
+    string path, token, error;
+    int min_depth = 4; // shallower entries are cheap to search again
+    iss >> path;
+    while (iss >> token)
+        if (token == "mindepth")
+            iss >> min_depth;
+    if (path.empty())
+    {
+        cout << "info string usage: savehash <file> [mindepth <d>] | loadhash <file>"
+             << "\n";
+        return;
+    }
+    uint64_t entries = 0;
+    if (command == "savehash" ? save_TT(ai.TT, path, min_depth, entries, error)
+                              : load_TT(ai.TT, path, entries, error))
+        cout << "info string " << (command == "savehash" ? "saved " : "loaded ")
+             << entries << " hash entries" << "\n";
+    else
+        cout << "info string " << error << "\n";
+}
+
+void uci_loop()
+{
+    Engine engine;
+    auto &ai = engine.ai;
+    auto &board = ai.board;
+    Tracer tracer;
+    string line, token;
+
+    while (getline(cin, line))
+    {
+        istringstream iss(line);
+        iss >> token;
+        if (token[0] == '#')
+            continue; // ignore comments
+        // a finished search may still be writing its bestmove or caching
+        // its result, the commands wait for it instead of racing with it
+        if (!ai.searching)
+            engine.wait();
+
+        if (token == "uci")
+        {
+            for (auto &option : spin_options(ai))
+                cout << "option name " << option.name << " type spin default "
+                     << option.default_value << " min " << option.min << " max "
+                     << option.max << "\n";
+            for (auto &option : check_options(ai))
+                cout << "option name " << option.name << " type check default "
+                     << (option.default_value ? "true" : "false") << "\n";
+            cout << "option name Hash type spin default 1 min 1 max " << TT_max_mb
+                 << "\n";
+            cout << "option name SharedHash type string default <empty>" << "\n";
+            cout << "option name HashFile type string default <empty>" << "\n";
+            cout << "uciok" << "\n";
+        }
+        else if (token == "ucinewgame")
+        {
+            ai.new_game();
+        }
+        else if (token == "position")
+        {
+            position_command(ai, iss);
+        }
+        else if (token == "go")
+        {
+            if (ai.searching)
+                continue; // don't touch the parameters of the running search
+            const int perft_depth = go_command(ai, iss);
+            if (perft_depth)
+                engine.run([&, perft_depth]()
+                           { divide(board, perft_depth); });
+            else
+                engine.start();
+        }
         else if (token == "stop")
         {
-            ai.searching = false;
-            if (ai_thread.joinable())
-                ai_thread.join();
+            engine.stop();
         }
         else if (token == "ponderhit")
         {
+            if (ai.pondering)
+                ai.ponderhit();
         }
         else if (token == "debug")
         {
@@ -2996,19 +5972,48 @@ void uci_loop()
             ai.debug_mode = token == "on";
             cout << "debug mode: " << (ai.debug_mode ? "on" : "off") << "\n";
         }
-        else if (token == "isready")
+        else if (token == "isready")
+        {
+            cout << "readyok" << "\n";
+        }
+        else if (token == "setoption")
+        {
+            const int threads = ai.threads;
+            const TT_t TT = ai.TT;
+            set_option(ai, iss);
+            if (ai.threads != threads || ai.TT != TT) // helpers share the TT
+                engine.set_threads(ai.threads);
+        }
+        else if (token == "register")
+        {
+        }
+        else if (token == "d")
+        {
+            board.print();
+        }
+        else if (token == "profile")
+        {
+            if (!ai.searching)
+                profile_command(ai, iss);
+        }
+        else if (token == "trace")
         {
-            cout << "readyok" << "\n";
+            if (!ai.searching)
+                trace_command(ai, tracer, iss);
         }
-        else if (token == "setoption")
+        else if (token == "stats")
         {
+            if (!ai.searching)
+                ai.print_stats(cout);
         }
-        else if (token == "register")
+        else if (token == "cache")
         {
+            cache_command(engine, iss);
         }
-        else if (token == "d")
+        else if (token == "savehash" || token == "loadhash")
         {
-            board.print();
+            if (!ai.searching)
+                hash_file_command(ai, token, iss);
         }
         else if (token == "quit")
         {
@@ -3034,14 +6039,11 @@ void uci_loop()
         }
         else if (token == "perft" || token == "divide")
         {
-            iss >> token;
+            int depth = 0;
+            iss >> depth;
             if (!ai.searching)
-            {
-                if (ai_thread.joinable())
-                    ai_thread.join();
-                ai_thread = thread([&]()
-                                   { divide(board, stoi(token)); });
-            }
+                engine.run([&, depth]()
+                           { divide(board, depth); });
         }
         else if (token == "moves")
         {
@@ -3057,6 +6059,20 @@ void uci_loop()
         {
             ai.eval<true>();
         }
+        else if (token == "evalbatch")
+        {
+            batch_eval_command(iss);
+        }
+        else if (token == "batch")
+        {
+            if (!ai.searching)
+                batch_command(iss);
+        }
+        else if (token == "epdsuite")
+        {
+            if (!ai.searching)
+                epdsuite_command(iss);
+        }
         else if (token == "isincheck")
         {
             cout << is_in_check(board, board.turn) << "\n";
@@ -3070,15 +6086,685 @@ void uci_loop()
             cout << "Invalid command: " << line << "\n";
         }
     }
+    engine.stop();
+}
+
+// server mode: UCI sessions of many clients over a Unix domain socket. Each
+// session has its own position and search tables, optionally one shared TT,
+// and their searches run on a fixed pool of worker threads. A session has at
+// most one search queued, the queue is first come first served and every
+// search is capped by the session budget, so no session holds a worker for
+// long or waits behind another session twice. Searches aren't preempted,
+// go infinite also ends at the budget
+struct ServerLimits
+{
+    int workers = 4;
+    int max_time = 10000;   // ms a search
+    uint64_t max_nodes = 0; // a search, 0 for no limit
+    int hash_mb = 1; // the shared TT's size, or each session's
+    bool shared_hash = false;
+    string hash_file; // the shared TT is mapped from it, kept across restarts
+    bool cache = false; // an analysis cache for all sessions
+    string cache_file; // its log, kept across restarts
+};
+
+struct Session
+{
+    int fd;
+    Search ai;
+    bool busy = false; // a search queued or running, guarded by the server
+    atomic<bool> stopped{false}; // by the client, the result is partial
+    uint64_t cache_key = 0;     // of the queued search, 0 if not cacheable
+    string cache_position;
+    SearchType cache_type = Fixed_depth;
+    LineCallbackBuf lines;
+    ostream line_stream;
+    mutex write_mutex; // the search and the session's reader both write
+    bool dropped = false; // the client stopped reading, guarded by write_mutex
+
+    Session(int fd, TT_t shared_TT, int hash_mb)
+        : fd(fd), ai(shared_TT, hash_mb), line_stream(&lines)
+    {
+        lines.callback = [this](const string &line)
+        { send(line); };
+        ai.out = &line_stream;
+    }
+    ~Session() { close(fd); }
+    void send(const string &line);
+};
+
+// never blocks, the shared workers write the search output. A client that
+// lets the socket's buffer fill up is too far behind and is dropped, its
+// reader then sees the socket closed
+void Session::send(const string &line)
+{
+    lock_guard<mutex> lock(write_mutex);
+    if (dropped)
+        return;
+    const string data = line + "\n";
+    for (size_t sent = 0; sent < data.size();)
+    {
+        const ssize_t n = ::send(fd, data.data() + sent, data.size() - sent,
+                                 MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        { // full, or the client is gone
+            dropped = true;
+            ai.searching = false;
+            shutdown(fd, SHUT_RDWR);
+            return;
+        }
+        sent += n;
+    }
+}
+
+// the next line from fd, buffer keeps what was read past it
+bool read_line(int fd, string &buffer, string &line)
+{
+    size_t end;
+    while ((end = buffer.find('\n')) == string::npos)
+    {
+        char data[4096];
+        const ssize_t n = read(fd, data, sizeof(data));
+        if (n <= 0)
+            return false;
+        buffer.append(data, n);
+    }
+    line = buffer.substr(0, end);
+    buffer.erase(0, end + 1);
+    if (line.size() && line.back() == '\r')
+        line.pop_back();
+    return true;
+}
+
+class SessionServer
+{
+public:
+    SessionServer(ServerLimits limits);
+    ~SessionServer();
+    int run(const string &path); // accepts clients until an error
+
+private:
+    ServerLimits limits;
+    TT_t shared_TT = nullptr;
+    TTStorage TT_storage = TTAllocated;
+    AnalysisCache cache;
+    mutex m;
+    condition_variable queued, done;
+    deque<shared_ptr<Session>> run_queue;
+    vector<thread> workers;
+    map<shared_ptr<Session>, thread> sessions; // and their readers
+    vector<thread> finished; // readers of ended sessions, to be joined
+    bool quit = false;
+    void worker();
+    void join_finished();
+    void serve(shared_ptr<Session> session);
+    void wait_idle(Session &session);
+};
+
+// throws runtime_error if the hash file can't be mapped or the shared TT
+// allocated
+SessionServer::SessionServer(ServerLimits _limits) : limits(_limits)
+{
+    string error;
+    if (limits.hash_file != "")
+    {
+        if (!(shared_TT = map_TT(limits.hash_file, true,
+                                 TT_entries_for(limits.hash_mb), error)))
+            throw runtime_error(error);
+        TT_storage = TTMapped;
+    }
+    else if (limits.shared_hash)
+    {
+        try
+        {
+            init_TT(shared_TT, TT_entries_for(limits.hash_mb));
+        }
+        catch (const bad_alloc &)
+        {
+            throw runtime_error("can't allocate a " + to_string(limits.hash_mb) +
+                                " MB hash");
+        }
+    }
+    if ((limits.cache || limits.cache_file != "") && !cache.open(limits.cache_file))
+    {
+        free_TT(shared_TT, TT_storage);
+        throw runtime_error("can't open " + limits.cache_file);
+    }
+    for (int i = 0; i < limits.workers; i++)
+        workers.emplace_back([this]()
+                             { worker(); });
+}
+
+SessionServer::~SessionServer()
+{
+    // the readers use the workers and the TT, they go first
+    {
+        unique_lock<mutex> lock(m);
+        for (auto &[session, reader] : sessions)
+        {
+            shutdown(session->fd, SHUT_RDWR);
+            session->ai.searching = false;
+        }
+        done.wait(lock, [this]()
+                  { return sessions.empty(); });
+    }
+    join_finished();
+    {
+        lock_guard<mutex> lock(m);
+        quit = true;
+    }
+    queued.notify_all();
+    for (auto &th : workers)
+        th.join();
+    free_TT(shared_TT, TT_storage);
+}
+
+void SessionServer::worker()
+{
+    unique_lock<mutex> lock(m);
+    while (true)
+    {
+        queued.wait(lock, [this]()
+                    { return quit || run_queue.size(); });
+        if (quit)
+            return;
+        auto session = run_queue.front();
+        run_queue.pop_front();
+        lock.unlock();
+        const int score = session->ai.search().second;
+        cache_result(cache, session->ai, session->cache_key,
+                     session->cache_position, session->cache_type, score,
+                     session->stopped);
+        lock.lock();
+        session->busy = false;
+        done.notify_all();
+    }
+}
+
+void SessionServer::join_finished()
+{
+    vector<thread> readers;
+    {
+        lock_guard<mutex> lock(m);
+        readers.swap(finished);
+    }
+    for (auto &th : readers)
+        th.join();
+}
+
+// commands that change the search wait for the session's search to end
+void SessionServer::wait_idle(Session &session)
+{
+    unique_lock<mutex> lock(m);
+    done.wait(lock, [&]()
+              { return !session.busy; });
+}
+
+void SessionServer::serve(shared_ptr<Session> session)
+{
+    auto &ai = session->ai;
+    string buffer, line, token;
+    while (read_line(session->fd, buffer, line))
+    {
+        istringstream iss(line);
+        if (!(iss >> token) || token[0] == '#')
+            continue;
+
+        if (token == "uci")
+        {
+            session->send("id name chess-engine session");
+            session->send("uciok");
+        }
+        else if (token == "isready")
+        {
+            session->send("readyok");
+        }
+        else if (token == "ucinewgame")
+        {
+            wait_idle(*session);
+            ai.new_game();
+        }
+        else if (token == "position")
+        {
+            wait_idle(*session);
+            position_command(ai, iss);
+        }
+        else if (token == "setoption")
+        {
+            // the server decides where the TT lives and its size, clients
+            // can't make it open files, leave the shared table or take memory
+            istringstream option(line);
+            string name;
+            option >> token >> token; // setoption name
+            while (option >> token && token != "value")
+                name += (name == "" ? "" : " ") + token;
+            if (lowercase(name) == "sharedhash" || lowercase(name) == "hashfile" ||
+                lowercase(name) == "hash")
+            {
+                session->send("info string option " + name +
+                              " isn't available in sessions");
+                continue;
+            }
+            wait_idle(*session);
+            ostringstream out;
+            set_option(ai, iss, out);
+            ai.threads = 1; // the workers are shared, a search gets one
+            if (out.str().size())
+                session->send(out.str().substr(0, out.str().size() - 1));
+        }
+        else if (token == "go")
+        {
+            // a client may answer bestmove before the worker is done with it
+            wait_idle(*session);
+            // idle, so the workers leave ai alone. Nothing is written to
+            // the socket under m, a slow client mustn't hold up the others
+            if (go_command(ai, iss))
+            {
+                session->send("info string perft isn't available in sessions");
+                continue;
+            }
+            ai.pondering = false;
+            // the server's limits don't change what the client asked for
+            pair<Move, int> result;
+            session->cache_key = cache.enabled() ? analysis_key(ai) : 0;
+            if (cached_search(cache, ai, session->cache_key, result))
+                continue;
+            session->cache_position =
+                session->cache_key ? analysis_position(ai.board) : "";
+            session->cache_type = ai.search_type;
+            session->stopped = false;
+            ai.max_time = limits.max_time;
+            if (limits.max_nodes)
+                ai.max_nodes = ai.max_nodes ? min(ai.max_nodes, limits.max_nodes)
+                                            : limits.max_nodes;
+            ai.searching = true;
+            lock_guard<mutex> lock(m);
+            session->busy = true;
+            run_queue.push_back(session);
+            queued.notify_one();
+        }
+        else if (token == "stop")
+        {
+            if (ai.searching)
+                session->stopped = true;
+            ai.searching = false;
+        }
+        else if (token == "quit")
+        {
+            break;
+        }
+        else
+        {
+            session->send("info string unknown command " + token);
+        }
+    }
     ai.searching = false;
-    if (ai_thread.joinable())
-        ai_thread.join();
+    wait_idle(*session);
+
+    lock_guard<mutex> lock(m);
+    auto it = sessions.find(session);
+    finished.push_back(std::move(it->second));
+    sessions.erase(it);
+    done.notify_all();
 }
 
-int main()
+int SessionServer::run(const string &path)
 {
-    zobrist_init();
-    uci_loop();
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (listen_fd < 0 || path.size() >= sizeof(address.sun_path))
+    {
+        cerr << "can't create socket " << path << "\n";
+        return 1;
+    }
+    strcpy(address.sun_path, path.c_str());
+    unlink(path.c_str());
+    if (bind(listen_fd, (sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listen_fd, 128) < 0)
+    {
+        cerr << "can't listen on " << path << "\n";
+        close(listen_fd);
+        return 1;
+    }
+    cerr << "listening on " << path << " with " << limits.workers
+         << " workers" << "\n";
+
+    while (true)
+    {
+        const int fd = accept(listen_fd, nullptr, nullptr);
+        join_finished();
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+                continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+                errno == ENOMEM)
+            { // out of resources for now, sessions ending free them
+                this_thread::sleep_for(chrono::milliseconds(100));
+                continue;
+            }
+            cerr << "accept failed: " << strerror(errno) << "\n";
+            break;
+        }
+        shared_ptr<Session> session;
+        try
+        {
+            session = make_shared<Session>(fd, shared_TT, limits.hash_mb);
+        }
+        catch (const bad_alloc &)
+        { // no memory for its TT, the client is turned away
+            close(fd);
+            continue;
+        }
+        // the reader can't end before it's registered, it needs the lock
+        lock_guard<mutex> lock(m);
+        sessions[session] = thread([this, session]()
+                                   { serve(session); });
+    }
+    close(listen_fd);
+    unlink(path.c_str());
+    return 1;
+}
+
+// server <socket> [workers <n>] [maxtime <ms>] [maxnodes <n>] [hash <MB>]
+//        [sharedhash] [hashfile <path>] [cache] [cachefile <path>]
+int server_command(istringstream &iss)
+{
+    string path, token;
+    ServerLimits limits;
+    iss >> path;
+    while (iss >> token)
+    {
+        if (token == "workers")
+            iss >> limits.workers;
+        else if (token == "maxtime")
+            iss >> limits.max_time;
+        else if (token == "maxnodes")
+            iss >> limits.max_nodes;
+        else if (token == "hash")
+            iss >> limits.hash_mb;
+        else if (token == "sharedhash")
+            limits.shared_hash = true;
+        else if (token == "hashfile")
+            iss >> limits.hash_file;
+        else if (token == "cache")
+            limits.cache = true;
+        else if (token == "cachefile")
+            iss >> limits.cache_file;
+    }
+    if (path.empty())
+    {
+        cerr << "usage: server <socket> [workers <n>] [maxtime <ms>] "
+                "[maxnodes <n>] [hash <MB>] [sharedhash] [hashfile <path>] "
+                "[cache] [cachefile <path>]"
+             << "\n";
+        return 1;
+    }
+    limits.workers = max(limits.workers, 1);
+    limits.hash_mb = max(1, min(limits.hash_mb, TT_max_mb));
+    try
+    {
+        SessionServer server(limits);
+        return server.run(path);
+    }
+    catch (const runtime_error &e)
+    {
+        cerr << e.what() << "\n";
+        return 1;
+    }
+}
+
+// C API, see chessengine.h
+
+// the Zobrist keys are random, so they're made once for all engines
+void engine_init()
+{
+    static once_flag once;
+    call_once(once, []()
+              {
+                  zobrist_init();
+                  cuckoo_init(); });
+}
+
+struct chess_engine
+{
+    Engine engine;
+};
+
+// copies s with its terminating 0 if it fits in size bytes, returns its length
+size_t copy_string(const string &s, char *buffer, size_t size)
+{
+    if (buffer && size)
+    {
+        const size_t n = min(s.size(), size - 1);
+        memcpy(buffer, s.data(), n);
+        buffer[n] = 0;
+    }
+    return s.size();
+}
+
+int search_result(chess_engine *engine, char bestmove[6])
+{
+    auto &[move, score] = engine->engine.result;
+    if (bestmove)
+        copy_string(move.from == move.to ? "0000" : move.to_uci(), bestmove, 6);
+    return score;
+}
+
+// the defaults of go, then the limits given
+void set_limits(Search &ai, const chess_limits *limits)
+{
+    ai.pondering = false;
+    ai.search_moves.clear();
+    ai.search_type = Time_per_game;
+    ai.set_clock(30000, 30000, 0, 0);
+    ai.max_depth = 100;
+    if (!limits)
+        return;
+    if (limits->wtime)
+        ai.wtime = limits->wtime;
+    if (limits->btime)
+        ai.btime = limits->btime;
+    ai.winc = limits->winc;
+    ai.binc = limits->binc;
+    if (limits->depth)
+    {
+        ai.max_depth = limits->depth;
+        ai.search_type = Fixed_depth;
+    }
+    if (limits->mate)
+    {
+        ai.mate_moves = limits->mate;
+        ai.search_type = Mate;
+    }
+    if (limits->movetime)
+    {
+        ai.mtime = limits->movetime;
+        ai.search_type = Time_per_move;
+    }
+    if (limits->infinite)
+        ai.search_type = Infinite;
+}
+
+extern "C"
+{
+    chess_engine *chess_engine_create(void)
+    {
+        // the TT and the thread pool throw, exceptions can't cross into C
+        try
+        {
+            engine_init();
+            return new chess_engine;
+        }
+        catch (...)
+        {
+            return nullptr;
+        }
+    }
+
+    void chess_engine_destroy(chess_engine *engine) { delete engine; }
+
+    int chess_engine_set_position(chess_engine *engine, const char *fen,
+                                  const char *moves)
+    {
+        auto &ai = engine->engine.ai;
+        if (engine->engine.searching())
+            return -1;
+        Board board;
+        vector<uint64_t> repetitions;
+        if (fen && string(fen) != "startpos" && !board.load_fen(fen))
+            return -1;
+        istringstream iss(moves ? moves : "");
+        string token;
+        while (iss >> token)
+        {
+            const uint64_t hash = board.zobrist_hash();
+            if (!make_move_if_legal(board, token))
+                return -1;
+            repetitions.push_back(hash);
+        }
+        ai.board = board;
+        ai.repetitions = repetitions;
+        return 0;
+    }
+
+    size_t chess_engine_get_fen(chess_engine *engine, char *fen, size_t size)
+    {
+        return copy_string(engine->engine.ai.board.to_fen(), fen, size);
+    }
+
+    int chess_engine_set_option(chess_engine *engine, const char *name,
+                                const char *value)
+    {
+        auto &ai = engine->engine.ai;
+        if (engine->engine.searching() || !name || !value)
+            return -1;
+        const int threads = ai.threads;
+        const TT_t TT = ai.TT;
+        istringstream iss("name " + string(name) + " value " + string(value));
+        ostringstream errors;
+        if (!set_option(ai, iss, errors))
+            return -1;
+        if (ai.threads != threads || ai.TT != TT)
+            engine->engine.set_threads(ai.threads);
+        if ((lowercase(name) == "sharedhash" || lowercase(name) == "hashfile") &&
+            ai.TT == TT)
+            return -1; // the segment couldn't be used
+        if (lowercase(name) == "hash" && errors.str() != "")
+            return -1; // the table couldn't be allocated
+        return 0;
+    }
+
+    void chess_engine_new_game(chess_engine *engine)
+    {
+        engine->engine.stop();
+        engine->engine.ai.new_game();
+    }
+
+    int chess_engine_search(chess_engine *engine, const chess_limits *limits,
+                            char bestmove[6], chess_line_callback callback,
+                            void *user_data)
+    {
+        if (chess_engine_start(engine, limits, callback, user_data))
+        {
+            if (bestmove)
+                copy_string("0000", bestmove, 6);
+            return CHESS_ENGINE_BUSY;
+        }
+        return chess_engine_wait(engine, bestmove);
+    }
+
+    int chess_engine_start(chess_engine *engine, const chess_limits *limits,
+                           chess_line_callback callback, void *user_data)
+    {
+        auto &ai = engine->engine.ai;
+        if (engine->engine.searching())
+            return -1;
+        set_limits(ai, limits);
+        if (callback)
+            engine->engine.start([callback, user_data](const string &line)
+                                 { callback(line.c_str(), user_data); });
+        else
+            engine->engine.start(
+                [](const string &) {}); // the library doesn't write to stdout
+        return 0;
+    }
+
+    int chess_engine_stop(chess_engine *engine, char bestmove[6])
+    {
+        engine->engine.stop();
+        return search_result(engine, bestmove);
+    }
+
+    int chess_engine_wait(chess_engine *engine, char bestmove[6])
+    {
+        engine->engine.wait();
+        return search_result(engine, bestmove);
+    }
+
+    int chess_engine_is_searching(chess_engine *engine)
+    {
+        return engine->engine.searching();
+    }
+
+    int chess_engine_legal_moves(chess_engine *engine, char *moves, size_t size)
+    {
+        auto legal = generate_legal_moves(engine->engine.ai.board);
+        string list;
+        for (auto &move : legal)
+            list += (list.empty() ? "" : " ") + move.to_uci();
+        copy_string(list, moves, size);
+        return legal.size();
+    }
+
+    int chess_engine_in_check(chess_engine *engine)
+    {
+        auto &board = engine->engine.ai.board;
+        return is_in_check(board, board.turn);
+    }
+
+    uint64_t chess_engine_perft(chess_engine *engine, int depth)
+    {
+        Board board = engine->engine.ai.board;
+        return perft(board, depth, is_in_check(board, board.turn));
+    }
+
+    int chess_engine_eval(chess_engine *engine)
+    {
+        return engine->engine.ai.eval<false>();
+    }
+
+    int chess_engine_uci_main(int argc, char *argv[])
+    {
+        engine_init();
+        string args;
+        for (int i = 2; i < argc; i++)
+            args += string(argv[i]) + " ";
+        istringstream iss(args);
+        if (argc > 1 && string(argv[1]) == "evalbatch")
+        { // e.g. ./main evalbatch file fens.txt depth 2 > evals.txt
+            batch_eval_command(iss);
+            return 0;
+        }
+        if (argc > 1 && string(argv[1]) == "batch")
+        { // e.g. ./main batch positions.epd depth 10 out results.txt
+            batch_command(iss);
+            return 0;
+        }
+        if (argc > 1 && string(argv[1]) == "epdsuite")
+        { // e.g. ./main epdsuite wac.epd 1000
+            epdsuite_command(iss);
+            return 0;
+        }
+        if (argc > 1 && string(argv[1]) == "server")
+            return server_command(iss); // e.g. ./main server /tmp/chess.sock
+
+        uci_loop();
+        return 0;
+    }
 }
 
 // PENDING: the single file got messey, task: create different files for it to make it more accessable
@@ -0,0 +1,4 @@
+// the UCI engine binary, a client of libchessengine
+#include "chessengine.h"
+
+int main(int argc, char *argv[]) { return chess_engine_uci_main(argc, argv); }
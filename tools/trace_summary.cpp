@@ -0,0 +1,192 @@
+// summarizes a search trace written by the engine's "trace on <file>" command
+// build: g++ -std=c++17 -O2 -o trace_summary tools/trace_summary.cpp
+// usage: ./trace_summary <file> [top <n>]
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+// same layout as in engine.cpp
+enum TraceNodeType : uint8_t
+{
+    TraceEarly,
+    TracePV,
+    TraceCut,
+    TraceAll,
+    TraceQuiesce,
+};
+
+const char *node_type_names[] = {"early", "pv", "cut", "all", "quiesce"};
+
+struct TraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    uint64_t written;
+};
+
+struct TraceRecord
+{
+    int32_t alpha, beta, score;
+    uint32_t nodes;
+    uint16_t move;
+    uint16_t best_move;
+    uint8_t ply;
+    int8_t depth;
+    uint8_t type;
+    uint8_t cutoff_index;
+    uint8_t researches;
+    uint8_t unused[3];
+};
+
+// move_code: from | to << 6 | promotion << 12, square 0 is a8
+string move_to_uci(uint16_t code)
+{
+    auto square = [](int sq)
+    { return string(1, 'a' + sq % 8) + string(1, '8' - sq / 8); };
+    string uci = square(code & 63) + square(code >> 6 & 63);
+    const int promotion = code >> 12;
+    if (promotion)
+        uci += " pnbrqk"[promotion];
+    return uci;
+}
+
+double percent(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+struct DepthSummary
+{
+    uint64_t nodes = 0, subtree = 0, researches = 0, cuts = 0, expanded = 0;
+};
+
+struct MoveSummary
+{
+    uint64_t searches = 0, subtree = 0, largest = 0;
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "usage: " << argv[0] << " <trace file> [top <n>]" << "\n";
+        return 1;
+    }
+    size_t top = 20;
+    if (argc >= 4 && string(argv[2]) == "top")
+        top = stoul(argv[3]);
+
+    const int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(TraceHeader))
+    {
+        cerr << "can't read " << argv[1] << "\n";
+        return 1;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        cerr << "can't map " << argv[1] << "\n";
+        return 1;
+    }
+
+    auto *header = (const TraceHeader *)data;
+    if (memcmp(header->magic, "CHSTRACE", 8) || header->version != 1 ||
+        header->record_size != sizeof(TraceRecord) ||
+        sizeof(TraceHeader) + header->capacity * sizeof(TraceRecord) > size_t(st.st_size))
+    {
+        cerr << argv[1] << " is not a version 1 trace" << "\n";
+        return 1;
+    }
+    auto *records = (const TraceRecord *)(header + 1);
+    const uint64_t count = min(header->written, header->capacity);
+    const uint64_t first = header->written - count; // oldest kept record
+
+    uint64_t types[5] = {};
+    map<int, uint64_t> cutoff_index; // of cut nodes
+    map<int, DepthSummary> depths;
+    map<uint16_t, MoveSummary> root_moves; // children of the root
+    for (uint64_t i = first; i < header->written; i++)
+    {
+        auto &record = records[i % header->capacity];
+        types[min<int>(record.type, 4)]++;
+        if (record.type == TraceCut)
+            cutoff_index[min<int>(record.cutoff_index, 10)]++;
+
+        auto &depth = depths[record.depth];
+        depth.nodes++;
+        depth.subtree += record.nodes;
+        depth.researches += record.researches;
+        depth.cuts += record.type == TraceCut;
+        depth.expanded += record.type == TracePV || record.type == TraceCut ||
+                          record.type == TraceAll;
+
+        if (record.ply == 1)
+        {
+            auto &move = root_moves[record.move];
+            move.searches++;
+            move.subtree += record.nodes;
+            move.largest = max<uint64_t>(move.largest, record.nodes);
+        }
+    }
+
+    cout << fixed << setprecision(1);
+    cout << "records " << count << " of " << header->written << " written"
+         << "\n\n";
+
+    cout << "node types" << "\n";
+    for (int t = 0; t < 5; t++)
+        cout << "  " << setw(8) << node_type_names[t] << setw(12) << types[t]
+             << setw(8) << percent(types[t], count) << "%" << "\n";
+
+    cout << "\n"
+         << "cutoff move number, of " << types[TraceCut] << " cut nodes" << "\n";
+    for (auto &[index, n] : cutoff_index)
+        cout << "  " << setw(8) << (index == 10 ? "10+" : to_string(index))
+             << setw(12) << n << setw(8) << percent(n, types[TraceCut]) << "%"
+             << "\n";
+
+    cout << "\n"
+         << "  depth       nodes  avg subtree  re-searches/node   cut%" << "\n";
+    for (auto it = depths.rbegin(); it != depths.rend(); it++)
+    {
+        auto &d = it->second;
+        cout << setw(7) << it->first << setw(12) << d.nodes << setw(13)
+             << double(d.subtree) / d.nodes << setw(18)
+             << (d.expanded ? double(d.researches) / d.expanded : 0.0) << setw(7)
+             << percent(d.cuts, d.nodes) << "\n";
+    }
+
+    vector<pair<uint16_t, MoveSummary>> moves(root_moves.begin(), root_moves.end());
+    sort(moves.begin(), moves.end(), [](auto &a, auto &b)
+         { return a.second.subtree > b.second.subtree; });
+    if (moves.size() > top)
+        moves.resize(top);
+    cout << "\n"
+         << "root move   searches     subtree   share   largest" << "\n";
+    uint64_t root_subtree = 0;
+    for (auto &[code, move] : root_moves)
+        root_subtree += move.subtree;
+    for (auto &[code, move] : moves)
+        cout << setw(9) << move_to_uci(code) << setw(11) << move.searches
+             << setw(12) << move.subtree << setw(7)
+             << percent(move.subtree, root_subtree) << "%" << setw(10)
+             << move.largest << "\n";
+
+    munmap(data, st.st_size);
+    return 0;
+}